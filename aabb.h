@@ -0,0 +1,90 @@
+#pragma once
+
+#include <limits>
+
+#include "common/vectorclass/vector3d.h"
+#include "ray.h"
+
+// Axis-aligned bounding box, empty (min > max) when default constructed
+template <typename T>
+struct basic_aabb
+{
+    using vec3 = vec3_t<T>;
+    using vec4 = typename vector_types<T>::vec4;
+    using packet = typename vector_types<T>::packet;
+
+    vec3 min = vec3(std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity());
+    vec3 max = vec3(-std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity());
+
+    bool is_empty() const
+    {
+        return horizontal_or(min.to_vector() > max.to_vector());
+    }
+
+    void grow(const vec3& point)
+    {
+        min = vec3(::min(min.to_vector(), point.to_vector()));
+        max = vec3(::max(max.to_vector(), point.to_vector()));
+    }
+
+    void grow(const basic_aabb& box)
+    {
+        min = vec3(::min(min.to_vector(), box.min.to_vector()));
+        max = vec3(::max(max.to_vector(), box.max.to_vector()));
+    }
+
+    vec3 centre() const
+    {
+        return (min + max) * T(0.5);
+    }
+
+    vec3 extent() const
+    {
+        return max - min;
+    }
+
+    T surface_area() const
+    {
+        if (is_empty())
+            return 0;
+
+        const vec3 e = extent();
+        return 2 * (e.get_x() * e.get_y() + e.get_y() * e.get_z() + e.get_z() * e.get_x());
+    }
+
+    // Slab test, returns the distance the ray enters the box at or infinity if it misses it within [t_min, t_max].
+    // inv_direction is 1 / direction per component, computed once per ray.
+    T ray_entry(const vec3& origin, const vec3& inv_direction, T t_min, T t_max) const
+    {
+        const vec4 t0 = (min - origin).to_vector() * inv_direction.to_vector();
+        const vec4 t1 = (max - origin).to_vector() * inv_direction.to_vector();
+
+        // The unused fourth lane takes the ray's own range so it never decides the result
+        const vec4 t_near = blend4<0, 1, 2, 7>(::min(t0, t1), vec4(t_min));
+        const vec4 t_far = blend4<0, 1, 2, 7>(::max(t0, t1), vec4(t_max));
+
+        const T entry = horizontal_max(t_near);
+        const T exit = horizontal_min(t_far);
+        return entry <= exit ? entry : std::numeric_limits<T>::infinity();
+    }
+
+    // Slab test for a packet of rays at once, given as x, y and z vectors, returning infinity in the lanes that miss
+    packet ray_entry(const packet (&origin)[3], const packet (&inv_direction)[3], T t_min, const packet& t_max) const
+    {
+        const T box_min[3] = { min.get_x(), min.get_y(), min.get_z() };
+        const T box_max[3] = { max.get_x(), max.get_y(), max.get_z() };
+
+        packet t_near = t_min;
+        packet t_far = t_max;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const packet t0 = (packet(box_min[axis]) - origin[axis]) * inv_direction[axis];
+            const packet t1 = (packet(box_max[axis]) - origin[axis]) * inv_direction[axis];
+            t_near = ::max(t_near, ::min(t0, t1));
+            t_far = ::min(t_far, ::max(t0, t1));
+        }
+        return select(t_near <= t_far, t_near, packet(std::numeric_limits<T>::infinity()));
+    }
+};
+
+using aabb = basic_aabb<double>;
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <span>
+#include <vector>
+
+// Picks an index in proportion to its weight in constant time with Vose's alias method: every entry is
+// split between itself and one alias so all entries are equally likely, and one uniform number picks
+// both the entry and which of its two indices to return. sample_ordered() picks from the same weights in
+// index order instead, in log time, for stratified samples the alias method would scatter.
+class alias_table
+{
+public:
+	alias_table() = default;
+
+	// Empty if no weight is positive. Negative weights count as zero.
+	explicit alias_table(std::span<const double> weights)
+	{
+		const int count = (int)weights.size();
+		double total = 0;
+		for (double weight : weights)
+		{
+			total += std::max(weight, 0.0);
+		}
+		if (!(total > 0))
+			return;
+
+		entries.resize(count);
+		probabilities.resize(count);
+		std::vector<double> scaled(count);
+		std::vector<int> small, large;
+		for (int i = 0; i < count; ++i)
+		{
+			probabilities[i] = std::max(weights[i], 0.0) / total;
+			scaled[i] = probabilities[i] * count;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+
+		// Each entry below the average is topped up from one above it, which may then drop below the average itself
+		while (!small.empty() && !large.empty())
+		{
+			const int under = small.back();
+			small.pop_back();
+			const int over = large.back();
+			entries[under] = { (float)scaled[under], over };
+			scaled[over] -= 1 - scaled[under];
+			if (scaled[over] < 1)
+			{
+				large.pop_back();
+				small.push_back(over);
+			}
+		}
+
+		cumulative.resize(count);
+		std::partial_sum(probabilities.begin(), probabilities.end(), cumulative.begin());
+
+		// Whatever is left is within rounding of the average
+		for (int i : large)
+		{
+			entries[i] = { 1, i };
+		}
+		for (int i : small)
+		{
+			entries[i] = { 1, i };
+		}
+	}
+
+	bool empty() const
+	{
+		return entries.empty();
+	}
+
+	int size() const
+	{
+		return (int)entries.size();
+	}
+
+	// Index picked by u in [0, 1), which must not be empty, with where in the part of its entry that picked
+	// it u fell scaled back up to [0, 1) in remainder for another decision to use
+	int sample(double u, double& remainder) const
+	{
+		const double scaled = u * entries.size();
+		const int i = std::min((int)scaled, (int)entries.size() - 1);
+		const double fraction = scaled - i;
+		const double threshold = entries[i].threshold;
+		const bool own = fraction < threshold;
+		remainder = std::min(own ? fraction / threshold : (fraction - threshold) / (1 - threshold), std::nextafter(1.0, 0.0));
+		return own ? i : entries[i].alias;
+	}
+
+	// Index whose share of [0, 1), laid out in index order, u falls in, with where in that share it fell
+	// scaled back up to [0, 1) in remainder for another decision to use. Takes log time rather than
+	// constant, but nearby u pick nearby indices, so stratified samples stay stratified over the indices.
+	int sample_ordered(double u, double& remainder) const
+	{
+		const int i = std::min((int)(std::upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin()), (int)cumulative.size() - 1);
+		const double start = i > 0 ? cumulative[i - 1] : 0.0;
+		remainder = std::clamp((u - start) / probabilities[i], 0.0, std::nextafter(1.0, 0.0));
+		return i;
+	}
+
+	// Probability sample() and sample_ordered() pick index with
+	double probability(int index) const
+	{
+		return probabilities[index];
+	}
+
+private:
+	struct entry
+	{
+		float threshold; // Fraction of the entry that picks its own index, the rest picks alias
+		int alias;
+	};
+
+	std::vector<entry> entries;
+	std::vector<double> cumulative; // Of probabilities, for sample_ordered()
+	std::vector<double> probabilities;
+};
@@ -0,0 +1,1099 @@
+#pragma once
+
+#include "instance.h"
+#include "renderer.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include "triangle_mesh.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numbers>
+#include <numeric>
+#include <span>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+// Benchmarks compare renderer features on the scene from main, selected with "--benchmark <name>".
+// They start from the renderer settings main uses, scaled down to a quarter of the resolution and at
+// most 64 samples per pixel so the reference renders finish in minutes, and never write any files.
+
+inline renderer benchmark_settings(renderer settings)
+{
+	settings.image_width = std::max(settings.image_width / 4, 1);
+	settings.image_height = std::max(settings.image_height / 4, 1);
+	settings.num_samples = std::min(settings.num_samples, 64);
+	settings.output_file.clear();
+	settings.checkpoint_file.clear();
+	settings.adaptive_sampling = false;
+	settings.progressive = false;
+	settings.time_budget = 0;
+	return settings;
+}
+
+// Root mean square error between two linear images, clamped to the displayable [0, 1] range first
+// so a handful of fireflies can't dominate the result
+inline double image_rmse(const renderer::image_buffer& image, const renderer::image_buffer& reference)
+{
+	double sum = 0;
+	for (size_t i = 0; i < image.size(); ++i)
+	{
+		const fRGBA difference = Saturate(image.data()[i]) - Saturate(reference.data()[i]);
+		sum += difference.R * difference.R + difference.G * difference.G + difference.B * difference.B;
+	}
+	return sqrt(sum / (image.size() * 3));
+}
+
+// Root mean square difference between colours and reference, each relative to the brightness of its reference
+// colour with a floor for black, so the brightest texels like the sun don't drown out the rest
+inline double relative_rms(std::span<const fRGBA> colours, std::span<const fRGBA> reference)
+{
+	double sum = 0;
+	for (size_t i = 0; i < colours.size(); ++i)
+	{
+		const fRGBA difference = colours[i] - reference[i];
+		const float brightness = std::max({ reference[i].R, reference[i].G, reference[i].B, 1e-3f });
+		sum += (difference.R * difference.R + difference.G * difference.G + difference.B * difference.B) / (3 * brightness * brightness);
+	}
+	return sqrt(sum / colours.size());
+}
+
+// Calls fn with the path of every .hdr file in the working directory, or says there are none
+template <typename fn_t>
+void for_each_hdr_file(fn_t&& fn)
+{
+	bool found = false;
+	for (const auto& entry : std::filesystem::directory_iterator("."))
+	{
+		if (entry.path().extension() != ".hdr")
+			continue;
+
+		found = true;
+		fn(entry.path());
+	}
+
+	if (!found)
+		std::cerr << "No .hdr files in the working directory\n";
+}
+
+// Renders a reference at 16x num_samples, then plain depth-limited paths at num_samples and
+// Russian roulette paths progressively for the same time, and compares the two
+inline void benchmark_russian_roulette(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+	settings.integrator.russian_roulette = false;
+
+	renderer::render_stats stats;
+
+	std::cout << "Reference, " << settings.num_samples * 16 << " samples per pixel\n";
+	renderer reference_renderer = settings;
+	reference_renderer.num_samples = settings.num_samples * 16;
+	reference_renderer.seed = settings.seed + 1;
+	const renderer::image_buffer reference = reference_renderer.render_image(cam, sc, stats);
+
+	std::cout << "\nDepth-limited paths, " << settings.num_samples << " samples per pixel\n";
+	const renderer::image_buffer plain = settings.render_image(cam, sc, stats);
+	const renderer::render_stats plain_stats = stats;
+
+	std::cout << "\nRussian roulette paths, " << plain_stats.seconds << "s budget\n";
+	renderer roulette_renderer = settings;
+	roulette_renderer.integrator.russian_roulette = true;
+	roulette_renderer.progressive = true;
+	roulette_renderer.num_samples = std::numeric_limits<int>::max();
+	roulette_renderer.samples_per_pass = std::max(settings.num_samples / 16, 1);
+	roulette_renderer.time_budget = plain_stats.seconds;
+	const renderer::image_buffer roulette = roulette_renderer.render_image(cam, sc, stats);
+	const renderer::render_stats roulette_stats = stats;
+
+	auto report = [](const char* name, const renderer::render_stats& stats, double rmse)
+	{
+		std::cout << name << ": " << stats.average_samples_per_pixel << " samples/pixel, " << stats.rays_per_pixel << " rays/pixel, "
+			<< stats.rays_per_pixel / stats.average_samples_per_pixel << " rays/sample, " << stats.seconds << "s, RMSE " << rmse << '\n';
+	};
+	std::cout << '\n';
+	report("Depth-limited   ", plain_stats, image_rmse(plain, reference));
+	report("Russian roulette", roulette_stats, image_rmse(roulette, reference));
+}
+
+// Builds BVHs over the bounds of a million randomly placed spheres, on every hardware thread and on one,
+// then packs the same spheres into a sphere_set, which builds one BVH over the spheres and another over
+// their packets
+inline void benchmark_bvh_build()
+{
+	constexpr int sphere_count = 1000000;
+	seed_random(0);
+	sphere_set set;
+	std::vector<aabb> bounds(sphere_count);
+	for (aabb& box : bounds)
+	{
+		const double radius = random_double(0.01, 0.1);
+		const Vec3Dd center(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+		set.add(center, radius, 0);
+		box = aabb{ .min = center - Vec3Dd(radius, radius, radius), .max = center + Vec3Dd(radius, radius, radius) };
+	}
+
+	auto report = [](const char* name, const bvh::build_stats& stats)
+	{
+		std::cout << name << ": " << stats.seconds << "s, " << stats.node_count << " nodes, depth " << stats.depth << ", leaves of "
+			<< stats.average_leaf_size << " average and " << stats.largest_leaf << " largest, SAH cost " << stats.sah_cost << '\n';
+	};
+
+	bvh tree;
+	report("Every thread", tree.build(bounds));
+	report("One thread  ", tree.build(bounds, 1));
+
+	const auto start_time = std::chrono::steady_clock::now();
+	set.prepare();
+	std::cout << "sphere_set of " << set.size() << " spheres prepared in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() << "s\n";
+}
+
+// Scatters 10000 small spheres over the scene, then renders it with them as separate sphere objects
+// and as one sphere_set, and compares the two
+inline void benchmark_sphere_set(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+
+	// Both scenes share the materials table, so the indices are the same in each
+	scene separate = { .objects = sc.objects, .materials = sc.materials, .sky_material = sc.sky_material };
+	const int materials[] = {
+		separate.add_material(std::make_shared<basic_colour_material>(fRGBA(0.7f, 0.2f, 0.2f))),
+		separate.add_material(std::make_shared<basic_colour_material>(fRGBA(0.2f, 0.6f, 0.3f))),
+		separate.add_material(std::make_shared<basic_metal_material>(fRGBA(0.8f, 0.8f, 0.8f))),
+	};
+	scene packed = { .objects = sc.objects, .materials = separate.materials, .sky_material = sc.sky_material };
+	auto set = std::make_shared<sphere_set>();
+
+	seed_random(settings.seed);
+	for (int i = 0; i < 10000; ++i)
+	{
+		const double radius = random_double(0.02, 0.08);
+		const Vec3Dd center(random_double(-8, 8), radius, random_double(1.5, 20));
+		const int mat = materials[i % std::size(materials)];
+		separate.objects.push_back(std::make_shared<sphere>(center, radius, mat));
+		set->add(center, radius, mat);
+	}
+	packed.objects.push_back(set);
+
+	renderer::render_stats stats;
+
+	std::cout << "Separate spheres\n";
+	const renderer::image_buffer separate_image = settings.render_image(cam, separate, stats);
+	const renderer::render_stats separate_stats = stats;
+
+	std::cout << "\nSphere set\n";
+	const renderer::image_buffer packed_image = settings.render_image(cam, packed, stats);
+	const renderer::render_stats packed_stats = stats;
+
+	std::cout << "\nSeparate spheres: " << separate_stats.seconds << "s, " << separate_stats.rays_per_pixel * settings.image_width * settings.image_height / separate_stats.seconds / 1e6 << " Mrays/s\n";
+	std::cout << "Sphere set:       " << packed_stats.seconds << "s, " << packed_stats.rays_per_pixel * settings.image_width * settings.image_height / packed_stats.seconds / 1e6 << " Mrays/s\n";
+	std::cout << "RMSE between them " << image_rmse(packed_image, separate_image) << '\n';
+}
+
+// Builds a cluster of 1000 spheres and scatters 100 rotated and scaled copies of it over the scene,
+// then renders them as instances of the one cluster and as one sphere_set holding every copy
+inline void benchmark_instances(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+
+	scene instanced = { .objects = sc.objects, .materials = sc.materials, .sky_material = sc.sky_material };
+	const int materials[] = {
+		instanced.add_material(std::make_shared<basic_colour_material>(fRGBA(0.7f, 0.2f, 0.2f))),
+		instanced.add_material(std::make_shared<basic_colour_material>(fRGBA(0.2f, 0.6f, 0.3f))),
+		instanced.add_material(std::make_shared<basic_metal_material>(fRGBA(0.8f, 0.8f, 0.8f))),
+	};
+	scene flattened = { .objects = sc.objects, .materials = instanced.materials, .sky_material = sc.sky_material };
+
+	seed_random(settings.seed);
+	struct cluster_sphere
+	{
+		Vector3 center;
+		float radius;
+		int mat;
+	};
+	std::vector<cluster_sphere> cluster;
+	auto cluster_set = std::make_shared<sphere_set>();
+	for (int i = 0; i < 1000; ++i)
+	{
+		const float radius = (float)random_double(0.01, 0.04);
+		const Vector3 center((float)random_double(-0.5, 0.5), (float)random_double(radius, 0.6), (float)random_double(-0.5, 0.5));
+		cluster.push_back({ center, radius, materials[i % std::size(materials)] });
+		cluster_set->add(Vec3Dd(center.x, center.y, center.z), radius, cluster.back().mat);
+	}
+
+	auto flat_set = std::make_shared<sphere_set>();
+	for (int i = 0; i < 100; ++i)
+	{
+		const Vector3 translation((float)random_double(-8, 8), 0, (float)random_double(2, 20));
+		const Quaternion rotation(Vector3(0, 1, 0), (float)random_double(0, 2 * std::numbers::pi));
+		const float scale = (float)random_double(0.5, 1.5);
+		instanced.objects.push_back(std::make_shared<instance>(cluster_set, translation, rotation, Vector3(scale, scale, scale)));
+		for (const cluster_sphere& s : cluster)
+		{
+			const Vector3 center = (s.center * scale) * rotation + translation;
+			flat_set->add(Vec3Dd(center.x, center.y, center.z), s.radius * scale, s.mat);
+		}
+	}
+	flattened.objects.push_back(flat_set);
+
+	renderer::render_stats stats;
+
+	std::cout << "Instances\n";
+	const renderer::image_buffer instanced_image = settings.render_image(cam, instanced, stats);
+	const renderer::render_stats instanced_stats = stats;
+
+	std::cout << "\nFlattened copies\n";
+	const renderer::image_buffer flattened_image = settings.render_image(cam, flattened, stats);
+	const renderer::render_stats flattened_stats = stats;
+
+	std::cout << "\nInstances: " << cluster_set->size() << " spheres stored, " << instanced_stats.seconds << "s, " << instanced_stats.rays_per_pixel * settings.image_width * settings.image_height / instanced_stats.seconds / 1e6 << " Mrays/s\n";
+	std::cout << "Flattened: " << flat_set->size() << " spheres stored, " << flattened_stats.seconds << "s, " << flattened_stats.rays_per_pixel * settings.image_width * settings.image_height / flattened_stats.seconds / 1e6 << " Mrays/s\n";
+	std::cout << "RMSE between them " << image_rmse(instanced_image, flattened_image) << '\n';
+}
+// Renders a reference with next-event estimation at 16x num_samples, then paths that only find the sky
+// by scattering at num_samples and paths with next-event estimation at num_samples and a quarter of it,
+// and compares them all to the reference
+inline void benchmark_next_event_estimation(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+	settings.integrator.next_event_estimation = true;
+
+	renderer::render_stats stats;
+
+	std::cout << "Reference, " << settings.num_samples * 16 << " samples per pixel\n";
+	renderer reference_renderer = settings;
+	reference_renderer.num_samples = settings.num_samples * 16;
+	reference_renderer.seed = settings.seed + 1;
+	const renderer::image_buffer reference = reference_renderer.render_image(cam, sc, stats);
+
+	std::cout << "\nScattering only, " << settings.num_samples << " samples per pixel\n";
+	renderer plain_renderer = settings;
+	plain_renderer.integrator.next_event_estimation = false;
+	const renderer::image_buffer plain = plain_renderer.render_image(cam, sc, stats);
+	const renderer::render_stats plain_stats = stats;
+
+	std::cout << "\nNext-event estimation, " << settings.num_samples << " samples per pixel\n";
+	const renderer::image_buffer nee = settings.render_image(cam, sc, stats);
+	const renderer::render_stats nee_stats = stats;
+
+	renderer quarter_renderer = settings;
+	quarter_renderer.num_samples = std::max(settings.num_samples / 4, 1);
+	std::cout << "\nNext-event estimation, " << quarter_renderer.num_samples << " samples per pixel\n";
+	const renderer::image_buffer quarter = quarter_renderer.render_image(cam, sc, stats);
+	const renderer::render_stats quarter_stats = stats;
+
+	auto report = [](const char* name, const renderer::render_stats& stats, double rmse)
+	{
+		std::cout << name << ": " << stats.average_samples_per_pixel << " samples/pixel, " << stats.rays_per_pixel << " rays/pixel, "
+			<< stats.seconds << "s, RMSE " << rmse << '\n';
+	};
+	std::cout << '\n';
+	report("Scattering only      ", plain_stats, image_rmse(plain, reference));
+	report("Next-event estimation", nee_stats, image_rmse(nee, reference));
+	report("Next-event estimation", quarter_stats, image_rmse(quarter, reference));
+}
+
+// For full length paths and for paths of two rays, where the sampler makes the most difference, renders a
+// reference at 16x num_samples, then the random and Sobol samplers at num_samples and at a quarter and a
+// sixteenth of it, and compares them all to the reference
+inline void benchmark_samplers(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+
+	renderer::render_stats stats;
+	std::vector<std::string> results;
+	for (const int depth : { settings.recursion_depth, 2 })
+	{
+		std::cout << (results.empty() ? "" : "\n") << "Reference, depth " << depth << ", " << settings.num_samples * 16 << " samples per pixel\n";
+		renderer reference_renderer = settings;
+		reference_renderer.recursion_depth = depth;
+		reference_renderer.num_samples = settings.num_samples * 16;
+		reference_renderer.seed = settings.seed + 1;
+		const renderer::image_buffer reference = reference_renderer.render_image(cam, sc, stats);
+
+		for (const int divisor : { 16, 4, 1 })
+		{
+			for (const sampler_type sampling : { sampler_type::random, sampler_type::sobol })
+			{
+				const char* name = sampling == sampler_type::sobol ? "Sobol " : "Random";
+				renderer sample_renderer = settings;
+				sample_renderer.recursion_depth = depth;
+				sample_renderer.sampling = sampling;
+				sample_renderer.num_samples = std::max(settings.num_samples / divisor, 1);
+				std::cout << '\n' << name << ", depth " << depth << ", " << sample_renderer.num_samples << " samples per pixel\n";
+				const renderer::image_buffer image = sample_renderer.render_image(cam, sc, stats);
+
+				std::ostringstream result;
+				result << name << ", depth " << depth << ": " << sample_renderer.num_samples << " samples/pixel, " << stats.seconds << "s, RMSE " << image_rmse(image, reference);
+				results.push_back(result.str());
+			}
+		}
+	}
+
+	std::cout << '\n';
+	for (const std::string& result : results)
+	{
+		std::cout << result << '\n';
+	}
+}
+
+// Looks the sky up along a million random directions straight from its texture, from the baked octahedral
+// map one direction at a time and from the baked map in batches, and compares the results
+inline void benchmark_environment(const scene& sc)
+{
+	const auto* sky = dynamic_cast<const basic_sky_texture_material*>(sc.sky_material.get());
+	if (!sky)
+	{
+		std::cerr << "The scene's sky isn't a texture\n";
+		return;
+	}
+
+	const auto start_time = std::chrono::steady_clock::now();
+	const basic_sky_texture_material baked_sky(sky->tex);
+	const double bake_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	const basic_sky_texture_material texture_sky(sky->tex, false);
+
+	seed_random(0);
+	std::vector<Vec3Dd> directions(1 << 20);
+	for (Vec3Dd& direction : directions)
+	{
+		direction = random_unit_vector();
+	}
+
+	auto time = [](auto&& fn)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		fn();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	};
+
+	std::vector<fRGBA> texture_colours(directions.size());
+	const double texture_seconds = time([&]()
+		{
+			for (size_t i = 0; i < directions.size(); ++i)
+			{
+				texture_colours[i] = texture_sky.emitted(ray{ Vec3Dd(0, 0, 0), directions[i], 0 }, ray_intersection{});
+			}
+		});
+
+	std::vector<fRGBA> baked_colours(directions.size());
+	const double baked_seconds = time([&]()
+		{
+			for (size_t i = 0; i < directions.size(); ++i)
+			{
+				baked_colours[i] = baked_sky.emitted(ray{ Vec3Dd(0, 0, 0), directions[i], 0 }, ray_intersection{});
+			}
+		});
+
+	std::vector<fRGBA> batch_colours(directions.size());
+	const double batch_seconds = time([&]() { baked_sky.sky_emitted(directions, batch_colours); });
+
+	long long batch_mismatches = 0;
+	for (size_t i = 0; i < directions.size(); ++i)
+	{
+		const float brightness = std::max({ texture_colours[i].R, texture_colours[i].G, texture_colours[i].B, 1e-3f });
+		const fRGBA batch_difference = batch_colours[i] - baked_colours[i];
+		batch_mismatches += std::max({ fabs(batch_difference.R), fabs(batch_difference.G), fabs(batch_difference.B) }) > 1e-5f * brightness;
+	}
+
+	std::cout << "Baked in " << bake_seconds << "s\n";
+	std::cout << "Texture:        " << texture_seconds / directions.size() * 1e9 << "ns per lookup\n";
+	std::cout << "Baked:          " << baked_seconds / directions.size() * 1e9 << "ns per lookup, " << texture_seconds / baked_seconds << "x\n";
+	std::cout << "Baked, batched: " << batch_seconds / directions.size() * 1e9 << "ns per lookup, " << texture_seconds / batch_seconds << "x\n";
+	std::cout << "Relative RMS error of the baked sky " << relative_rms(baked_colours, texture_colours) << ", " << batch_mismatches << " batched lookups differ\n";
+}
+
+// Loads every .hdr file in the working directory with row major and with tiled texels, and times four
+// million bilinear lookups in each: at random, in clusters of 1024 within 128x128 texels like the rays of
+// neighbouring pixels, and down every other column, which is the worst case for row major texels
+inline void benchmark_texture_layout()
+{
+	auto time_lookups = [](const texture& tex, const std::vector<Vec2d>& coords)
+	{
+		fRGBA sum = fRGBA(0, 0, 0, 0);
+		const auto start_time = std::chrono::steady_clock::now();
+		for (const Vec2d& c : coords)
+		{
+			sum = sum + tex.sample(c);
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		return std::pair(seconds / coords.size() * 1e9, sum);
+	};
+
+	for_each_hdr_file([&](const std::filesystem::path& path)
+	{
+		const std::string file = path.string();
+		const texture2d<fRGBA> row_major(file.c_str(), false, true, false, texel_layout::row_major);
+		const texture2d<fRGBA> tiled(file.c_str(), false, true, false, texel_layout::tiled);
+		const int width = row_major.width();
+		const int height = row_major.height();
+		std::cout << file << ", " << width << "x" << height << '\n';
+
+		std::vector<Vec2d> random_coords(1 << 22), cluster_coords(1 << 22), column_coords(1 << 22);
+		seed_random(0);
+		for (Vec2d& coords : random_coords)
+		{
+			coords = Vec2d(random_double(), random_double());
+		}
+		for (size_t i = 0; i < cluster_coords.size(); i += 1024)
+		{
+			const Vec2d corner(random_double(), random_double());
+			for (size_t j = i; j < i + 1024; ++j)
+			{
+				cluster_coords[j] = corner + Vec2d(random_double(0, 128.0 / width), random_double(0, 128.0 / height));
+			}
+		}
+		for (size_t i = 0; i < column_coords.size(); ++i)
+		{
+			column_coords[i] = Vec2d(((i / height * 2) % width + 0.5) / width, (i % height + 0.5) / height);
+		}
+
+		const std::pair<const char*, const std::vector<Vec2d>*> patterns[] = {
+			{ "Random  ", &random_coords }, { "Clusters", &cluster_coords }, { "Columns ", &column_coords } };
+		for (const auto& [name, coords] : patterns)
+		{
+			const auto [row_major_ns, row_major_sum] = time_lookups(row_major, *coords);
+			const auto [tiled_ns, tiled_sum] = time_lookups(tiled, *coords);
+			std::cout << name << ": row major " << row_major_ns << "ns per lookup, tiled " << tiled_ns << "ns, " << row_major_ns / tiled_ns << "x"
+				<< (row_major_sum.R == tiled_sum.R && row_major_sum.G == tiled_sum.G && row_major_sum.B == tiled_sum.B ? "" : ", results differ") << '\n';
+		}
+	});
+}
+
+// Loads every .hdr file in the working directory with single and with half precision texels, and compares
+// their size, the time of four million bilinear lookups at random and how much the lookups differ
+inline void benchmark_half_textures()
+{
+	auto time_lookups = [](const texture& tex, const std::vector<Vec2d>& coords, std::vector<fRGBA>& colours)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < coords.size(); ++i)
+		{
+			colours[i] = tex.sample(coords[i]);
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() / coords.size() * 1e9;
+	};
+
+	std::vector<Vec2d> coords(1 << 22);
+	seed_random(0);
+	for (Vec2d& c : coords)
+	{
+		c = Vec2d(random_double(), random_double());
+	}
+	std::vector<fRGBA> single_colours(coords.size()), half_colours(coords.size());
+
+	for_each_hdr_file([&](const std::filesystem::path& path)
+	{
+		const std::string file = path.string();
+		const texture2d<fRGBA> single(file.c_str(), false, true, false);
+		const texture2d<hRGBA> half(file.c_str(), false, true, false);
+		const double texels = (double)single.width() * single.height();
+		std::cout << file << ", " << single.width() << "x" << single.height() << '\n';
+
+		const double single_ns = time_lookups(single, coords, single_colours);
+		const double half_ns = time_lookups(half, coords, half_colours);
+
+		std::cout << "Single: " << texels * sizeof(fRGBA) / (1 << 20) << "MB, " << single_ns << "ns per lookup\n";
+		std::cout << "Half:   " << texels * sizeof(hRGBA) / (1 << 20) << "MB, " << half_ns << "ns per lookup, " << single_ns / half_ns << "x\n";
+		std::cout << "Relative RMS difference " << relative_rms(half_colours, single_colours) << '\n';
+	});
+}
+
+// Writes every .hdr file in the working directory out as a tiled texture file in the temporary directory,
+// then does four million lookups, at random and in clusters of 1024 within 128x128 texels, through caches
+// holding all of the file, an eighth and a sixty-fourth, and compares them with the texture held in memory.
+// The lookups are then split between as many threads as the renderer uses, through a cache with a single
+// lock and through one split into shards.
+inline void benchmark_texture_cache()
+{
+	// Wall time per lookup, with the lookups split into a contiguous run for each thread
+	auto time_lookups = [](const texture& tex, const std::vector<Vec2d>& coords, std::vector<fRGBA>& colours, int thread_count = 1)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; ++t)
+		{
+			threads.emplace_back([&, t]()
+			{
+				const size_t end = coords.size() * (t + 1) / thread_count;
+				for (size_t i = coords.size() * t / thread_count; i < end; ++i)
+				{
+					colours[i] = tex.sample(coords[i]);
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() / coords.size() * 1e9;
+	};
+	const int thread_count = std::max((int)std::thread::hardware_concurrency(), 1);
+
+	for_each_hdr_file([&](const std::filesystem::path& path)
+	{
+		const std::string file = path.string();
+		const texture2d<hRGBA> in_memory(file.c_str(), false, true);
+		const int width = in_memory.width();
+		const int height = in_memory.height();
+		const std::string tiled_file = (std::filesystem::temp_directory_path() / path.filename()).string() + ".tiles";
+		if (!write_tiled_texture(in_memory, tiled_file.c_str()))
+		{
+			std::cerr << "Couldn't write " << tiled_file << '\n';
+			return;
+		}
+		const size_t file_size = std::filesystem::file_size(tiled_file);
+		std::cout << file << ", " << width << "x" << height << ", " << file_size / double(1 << 20) << "MB tiled\n";
+
+		std::vector<Vec2d> random_coords(1 << 22), cluster_coords(1 << 22);
+		seed_random(0);
+		for (Vec2d& coords : random_coords)
+		{
+			coords = Vec2d(random_double(), random_double());
+		}
+		for (size_t i = 0; i < cluster_coords.size(); i += 1024)
+		{
+			const Vec2d corner(random_double(), random_double());
+			for (size_t j = i; j < i + 1024; ++j)
+			{
+				cluster_coords[j] = corner + Vec2d(random_double(0, 128.0 / width), random_double(0, 128.0 / height));
+			}
+		}
+
+		std::vector<fRGBA> expected(random_coords.size()), colours(random_coords.size());
+		const std::pair<const char*, const std::vector<Vec2d>*> patterns[] = { { "Random  ", &random_coords }, { "Clusters", &cluster_coords } };
+		for (const auto& [name, coords] : patterns)
+		{
+			std::cout << name << ": in memory " << time_lookups(in_memory, *coords, expected) << "ns per lookup\n";
+			for (const size_t budget : { file_size, file_size / 8, file_size / 64 })
+			{
+				const auto cache = std::make_shared<texture_cache>(budget);
+				const cached_texture<hRGBA> cached(cache, tiled_file.c_str(), false, true);
+				const double ns = time_lookups(cached, *coords, colours);
+				const texture_cache::statistics stats = cache->stats();
+				const long long mismatches = std::inner_product(colours.begin(), colours.end(), expected.begin(), 0ll, std::plus<>(),
+					[](const fRGBA& a, const fRGBA& b) { return a.R != b.R || a.G != b.G || a.B != b.B || a.A != b.A; });
+				std::cout << "  " << budget / double(1 << 20) << "MB cache: " << ns << "ns per lookup, " << 100.0 * stats.hits / (stats.hits + stats.misses)
+					<< "% of tiles hit, " << stats.misses << " read, " << stats.evictions << " evicted, " << mismatches << " lookups differ\n";
+
+				std::cout << "    " << thread_count << (thread_count == 1 ? " thread:" : " threads:");
+				for (const int shard_count : { 1, texture_cache::default_shard_count })
+				{
+					const auto shared_cache = std::make_shared<texture_cache>(budget, shard_count);
+					const cached_texture<hRGBA> shared(shared_cache, tiled_file.c_str(), false, true);
+					const double shared_ns = time_lookups(shared, *coords, colours, thread_count);
+					const texture_cache::statistics shared_stats = shared_cache->stats();
+					std::cout << (shard_count == 1 ? " " : ", ") << shared_cache->shard_count() << (shared_cache->shard_count() == 1 ? " shard " : " shards ") << shared_ns << "ns per lookup ("
+						<< 100.0 * shared_stats.hits / (shared_stats.hits + shared_stats.misses) << "% hit)";
+				}
+				std::cout << '\n';
+			}
+		}
+		std::filesystem::remove(tiled_file);
+	});
+}
+
+// Times 16 million uniform numbers and 4 million unit vectors from the batched generator against
+// std::uniform_real_distribution and normalised gaussians on the thread's pcg64_fast
+inline void benchmark_random()
+{
+	auto time = [](int count, auto&& fn)
+	{
+		double sum = 0;
+		const auto start_time = std::chrono::steady_clock::now();
+		for (int i = 0; i < count; ++i)
+		{
+			sum += fn();
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		return std::pair(seconds / count * 1e9, sum / count);
+	};
+
+	seed_random(0);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	const auto [pcg_ns, pcg_mean] = time(1 << 24, [&]() { return uniform(rand_generator()); });
+	const auto [batch_ns, batch_mean] = time(1 << 24, []() { return random_double(); });
+	const auto [vector_ns, vector_mean] = time(1 << 22, []() { return horizontal_add(random_double4()) * 0.25; });
+	const auto [gaussian_ns, gaussian_x] = time(1 << 22, []() { return normalize_vector(gaussian_3d())[0]; });
+	const auto [unit_ns, unit_x] = time(1 << 22, []() { return random_unit_vector()[0]; });
+
+	std::cout << "Uniform, pcg64_fast:    " << pcg_ns << "ns, mean " << pcg_mean << '\n';
+	std::cout << "Uniform, batched:       " << batch_ns << "ns, mean " << batch_mean << ", " << pcg_ns / batch_ns << "x\n";
+	std::cout << "Uniform, four at once:  " << vector_ns / 4 << "ns each, mean " << vector_mean << ", " << pcg_ns / (vector_ns / 4) << "x\n";
+	std::cout << "Unit vector, gaussians: " << gaussian_ns << "ns, mean x " << gaussian_x << '\n';
+	std::cout << "Unit vector, batched:   " << unit_ns << "ns, mean x " << unit_x << ", " << gaussian_ns / unit_ns << "x\n";
+}
+
+// Texture that counts its lookups by the mip level they pick, rounded to the nearest, with lookups without a
+// footprint at level 0 and the last count for footprints wider than the last level
+class level_counting_texture : public texture
+{
+public:
+	explicit level_counting_texture(std::shared_ptr<texture2d<RGBA>> tex)
+		: tex(std::move(tex))
+		, counts(this->tex->level_count() + 1)
+	{
+	}
+
+	fRGBA sample(Vec2d coords) const
+	{
+		++counts[0];
+		return tex->sample(coords);
+	}
+
+	fRGBA sample(Vec2d coords, float footprint) const
+	{
+		const float level = mip_level(footprint, tex->width(), tex->height());
+		++counts[level > 0 ? std::min((int)std::round(level), (int)counts.size() - 1) : 0];
+		return tex->sample(coords, footprint);
+	}
+
+	int width() const
+	{
+		return tex->width();
+	}
+
+	int height() const
+	{
+		return tex->height();
+	}
+
+	// Lookups per level since the last call, as percentages
+	std::string take_counts() const
+	{
+		long long total = 0;
+		for (const std::atomic<long long>& count : counts)
+		{
+			total += count;
+		}
+
+		std::ostringstream result;
+		for (size_t level = 0; level < counts.size(); ++level)
+		{
+			result << (level > 0 ? ", " : "") << level << ": " << std::setprecision(3) << (total > 0 ? 100.0 * counts[level].exchange(0) / total : 0.0) << '%';
+		}
+		return result.str();
+	}
+
+private:
+	std::shared_ptr<texture2d<RGBA>> tex;
+	mutable std::vector<std::atomic<long long>> counts;
+};
+
+// Scatters 2000 small spheres with a fine checkerboard texture over the scene and renders a reference at
+// 16x num_samples without ray cones. Then renders at num_samples sampling only the full resolution level,
+// mip mapped with ray cones, and mip mapped progressively for the same time, and compares them all to the
+// reference along with which mip levels their lookups picked.
+inline void benchmark_mip_maps(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+
+	// 1024x1024 texels in 4x4 checks, so a sphere is 128 checks across
+	constexpr int texture_size = 1024;
+	std::vector<RGBA> texels((size_t)texture_size * texture_size);
+	for (int y = 0; y < texture_size; ++y)
+	{
+		for (int x = 0; x < texture_size; ++x)
+		{
+			texels[(size_t)y * texture_size + x] = ((x / 4 + y / 4) % 2) ? RGBA(230, 230, 230, 255) : RGBA(40, 60, 160, 255);
+		}
+	}
+
+	scene textured = { .objects = sc.objects, .materials = sc.materials, .sky_material = sc.sky_material };
+	const auto checker_texture = std::make_shared<level_counting_texture>(std::make_shared<texture2d<RGBA>>(texture_size, texture_size, std::move(texels), false, false));
+	const int checker = textured.add_material(std::make_shared<basic_texture_material>(checker_texture));
+	auto set = std::make_shared<sphere_set>();
+
+	seed_random(settings.seed);
+	for (int i = 0; i < 2000; ++i)
+	{
+		const double radius = random_double(0.05, 0.15);
+		set->add(Vec3Dd(random_double(-8, 8), radius, random_double(1.5, 20)), radius, checker);
+	}
+	textured.objects.push_back(set);
+
+	renderer::render_stats stats;
+
+	std::cout << "Reference, " << settings.num_samples * 16 << " samples per pixel\n";
+	renderer reference_renderer = settings;
+	reference_renderer.num_samples = settings.num_samples * 16;
+	reference_renderer.seed = settings.seed + 1;
+	reference_renderer.ray_cones = false;
+	const renderer::image_buffer reference = reference_renderer.render_image(cam, textured, stats);
+	checker_texture->take_counts();
+
+	std::cout << "\nFull resolution, " << settings.num_samples << " samples per pixel\n";
+	renderer full_renderer = settings;
+	full_renderer.ray_cones = false;
+	const renderer::image_buffer full = full_renderer.render_image(cam, textured, stats);
+	const renderer::render_stats full_stats = stats;
+	const std::string full_levels = checker_texture->take_counts();
+
+	std::cout << "\nMip mapped, " << settings.num_samples << " samples per pixel\n";
+	settings.ray_cones = true;
+	const renderer::image_buffer mipped = settings.render_image(cam, textured, stats);
+	const renderer::render_stats mipped_stats = stats;
+	const std::string mipped_levels = checker_texture->take_counts();
+
+	std::cout << "\nMip mapped progressively, " << full_stats.seconds << "s budget\n";
+	renderer progressive_renderer = settings;
+	progressive_renderer.progressive = true;
+	progressive_renderer.num_samples = std::numeric_limits<int>::max();
+	progressive_renderer.samples_per_pass = std::max(settings.num_samples / 16, 1);
+	progressive_renderer.time_budget = full_stats.seconds;
+	const renderer::image_buffer progressive = progressive_renderer.render_image(cam, textured, stats);
+	const renderer::render_stats progressive_stats = stats;
+	const std::string progressive_levels = checker_texture->take_counts();
+
+	auto report = [](const char* name, const renderer::render_stats& stats, double rmse, const std::string& levels)
+	{
+		std::cout << name << ": " << stats.average_samples_per_pixel << " samples/pixel, " << stats.seconds << "s, RMSE " << rmse << "\n    lookups by level " << levels << '\n';
+	};
+	std::cout << '\n';
+	report("Full resolution        ", full_stats, image_rmse(full, reference), full_levels);
+	report("Mip mapped             ", mipped_stats, image_rmse(mipped, reference), mipped_levels);
+	report("Mip mapped progressively", progressive_stats, image_rmse(progressive, reference), progressive_levels);
+}
+
+// Traces the camera rays of every sample one at a time and then in packets, without shading
+// them, and checks both find the same hits
+inline void benchmark_ray_packets(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+	sc.prepare();
+
+	const camera_viewport viewport(cam, settings.image_width, settings.image_height);
+	std::vector<ray> rays;
+	rays.reserve((size_t)settings.image_width * settings.image_height * settings.num_samples);
+	seed_random(settings.seed);
+	for (int y = 0; y < settings.image_height; ++y)
+	{
+		for (int x = 0; x < settings.image_width; ++x)
+		{
+			for (int i = 0; i < settings.num_samples; ++i)
+			{
+				const double jitter_x = random_double();
+				const double jitter_y = random_double();
+				rays.push_back(viewport.primary_ray(x + jitter_x, y + jitter_y, settings.recursion_depth));
+			}
+		}
+	}
+
+	auto time = [](auto&& fn)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		fn();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	};
+
+	std::vector<double> single_t(rays.size());
+	const double single_seconds = time([&]()
+		{
+			for (size_t i = 0; i < rays.size(); ++i)
+			{
+				ray_intersection hit;
+				single_t[i] = sc.ray_intersect(rays[i], hit) ? hit.t : std::numeric_limits<double>::infinity();
+			}
+		});
+
+	std::vector<double> packet_t(rays.size());
+	const double packet_seconds = time([&]()
+		{
+			for (size_t i = 0; i < rays.size(); i += ray_packet::size)
+			{
+				const ray_packet packet(std::span<const ray>(rays).subspan(i, std::min<size_t>(ray_packet::size, rays.size() - i)));
+				ray_intersection hits[ray_packet::size];
+				const std::array<bool, ray_packet::size> has_hits = sc.ray_intersect(packet, hits);
+				for (int j = 0; j < packet.count; ++j)
+				{
+					packet_t[i + j] = has_hits[j] ? hits[j].t : std::numeric_limits<double>::infinity();
+				}
+			}
+		});
+
+	// The packet kernels sum their dot products in a different order, so distances can differ in the last bits
+	const long long mismatches = std::inner_product(single_t.begin(), single_t.end(), packet_t.begin(), 0LL, std::plus<>(),
+		[](double a, double b) { return a != b && !(fabs(a - b) <= 1e-9 * a); });
+	std::cout << rays.size() << " camera rays\n";
+	std::cout << "Single rays: " << single_seconds << "s, " << rays.size() / single_seconds / 1e6 << " Mrays/s\n";
+	std::cout << "Packets:     " << packet_seconds << "s, " << rays.size() / packet_seconds / 1e6 << " Mrays/s, " << single_seconds / packet_seconds << "x\n";
+	std::cout << mismatches << " rays hit differently\n";
+}
+
+// Casts an ambient occlusion ray of length ao_distance from where each camera ray of every sample
+// hits, then traces them as closest-hit queries and as occlusion queries and checks both agree
+inline void benchmark_occlusion(renderer settings, const camera& cam, const scene& sc)
+{
+	constexpr double ao_distance = 1.0;
+
+	settings = benchmark_settings(settings);
+	sc.prepare();
+
+	const camera_viewport viewport(cam, settings.image_width, settings.image_height);
+	std::vector<ray> rays;
+	rays.reserve((size_t)settings.image_width * settings.image_height * settings.num_samples);
+	seed_random(settings.seed);
+	for (int y = 0; y < settings.image_height; ++y)
+	{
+		for (int x = 0; x < settings.image_width; ++x)
+		{
+			for (int i = 0; i < settings.num_samples; ++i)
+			{
+				const double jitter_x = random_double();
+				const double jitter_y = random_double();
+				const ray camera_ray = viewport.primary_ray(x + jitter_x, y + jitter_y, settings.recursion_depth);
+				ray_intersection hit;
+				if (sc.ray_intersect(camera_ray, hit))
+				{
+					// Cosine-weighted over the side of the surface the camera sees, which the normal faces
+					rays.push_back(camera_ray.scatter(hit, normalize_vector(hit.normal + random_unit_vector())));
+				}
+			}
+		}
+	}
+
+	auto time = [](auto&& fn)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+		fn();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	};
+
+	std::vector<char> closest_occluded(rays.size());
+	const double closest_seconds = time([&]()
+		{
+			for (size_t i = 0; i < rays.size(); ++i)
+			{
+				ray_intersection hit;
+				closest_occluded[i] = sc.ray_intersect(rays[i], hit) && hit.t <= ao_distance;
+			}
+		});
+
+	std::vector<char> any_occluded(rays.size());
+	const double any_seconds = time([&]()
+		{
+			for (size_t i = 0; i < rays.size(); ++i)
+			{
+				any_occluded[i] = sc.occluded(rays[i], 0, ao_distance);
+			}
+		});
+
+	const long long occluded_count = std::count(any_occluded.begin(), any_occluded.end(), 1);
+	const long long mismatches = std::inner_product(closest_occluded.begin(), closest_occluded.end(), any_occluded.begin(), 0LL, std::plus<>(), std::not_equal_to<>());
+	std::cout << rays.size() << " ambient occlusion rays, " << occluded_count << " occluded\n";
+	std::cout << "Closest hit: " << closest_seconds << "s, " << rays.size() / closest_seconds / 1e6 << " Mrays/s\n";
+	std::cout << "Occlusion:   " << any_seconds << "s, " << rays.size() / any_seconds / 1e6 << " Mrays/s, " << closest_seconds / any_seconds << "x\n";
+	std::cout << mismatches << " rays disagree\n";
+}
+
+// Renders a diffuse quad in front of the camera under the sky three ways: wound to face the camera,
+// wound away from it so the camera sees its back, and facing the camera with vertex normals that point
+// away. Single-sided meshes shade the same from either side, so all three should match to within noise.
+inline void benchmark_mesh_sides(renderer settings, const camera& cam, const scene& sc)
+{
+	settings = benchmark_settings(settings);
+
+	const std::pair<const char*, const char*> quads[] = {
+		{ "Facing the camera  ", "f 1 3 2\nf 1 4 3\n" },
+		{ "Seen from behind   ", "f 1 2 3\nf 1 3 4\n" },
+		{ "Normals facing away", "f 1//1 3//1 2//1\nf 1//1 4//1 3//1\n" },
+	};
+	const std::string obj_file = (std::filesystem::temp_directory_path() / "mesh_sides.obj").string();
+
+	renderer::image_buffer facing;
+	for (const auto& [name, faces] : quads)
+	{
+		{
+			std::ofstream obj(obj_file);
+			obj << "v -1 -0.5 1.5\nv 1 -0.5 1.5\nv 1 1.5 1.5\nv -1 1.5 1.5\nvn 0 0 1\n" << faces;
+		}
+		scene quad_scene = { .materials = sc.materials, .sky_material = sc.sky_material };
+		const int grey = quad_scene.add_material(std::make_shared<basic_colour_material>(fRGBA(0.5f, 0.5f, 0.5f)));
+		quad_scene.objects.push_back(std::make_shared<triangle_mesh>(obj_file.c_str(), grey));
+
+		std::cout << name << '\n';
+		renderer::render_stats stats;
+		const renderer::image_buffer image = settings.render_image(cam, quad_scene, stats);
+		double mean = 0;
+		for (size_t i = 0; i < image.size(); ++i)
+		{
+			const fRGBA& c = image.data()[i];
+			mean += (c.R + c.G + c.B) / 3;
+		}
+		if (facing.size() == 0)
+			facing = image;
+		std::cout << name << ": mean " << mean / image.size() << ", RMSE against facing " << image_rmse(image, facing) << "\n\n";
+	}
+	std::filesystem::remove(obj_file);
+}
+
+// Camera rays of every sample traced in packets in the precision of T, without shading them.
+// Returns the rays traced per second.
+template <typename T>
+double packet_trace_rate(const renderer& settings, const camera& cam, const basic_scene<T>& sc)
+{
+	sc.prepare();
+
+	const basic_camera_viewport<T> viewport(cam, settings.image_width, settings.image_height);
+	std::vector<basic_ray<T>> rays;
+	rays.reserve((size_t)settings.image_width * settings.image_height * settings.num_samples);
+	seed_random(settings.seed);
+	for (int y = 0; y < settings.image_height; ++y)
+	{
+		for (int x = 0; x < settings.image_width; ++x)
+		{
+			for (int i = 0; i < settings.num_samples; ++i)
+			{
+				const double jitter_x = random_double();
+				const double jitter_y = random_double();
+				rays.push_back(viewport.primary_ray(x + jitter_x, y + jitter_y, settings.recursion_depth));
+			}
+		}
+	}
+
+	const auto start_time = std::chrono::steady_clock::now();
+	long long hits = 0;
+	for (size_t i = 0; i < rays.size(); i += basic_ray_packet<T>::size)
+	{
+		const basic_ray_packet<T> packet(std::span<const basic_ray<T>>(rays).subspan(i, std::min<size_t>(basic_ray_packet<T>::size, rays.size() - i)));
+		basic_ray_intersection<T> packet_hits[basic_ray_packet<T>::size];
+		for (bool has_hit : sc.ray_intersect(packet, packet_hits))
+		{
+			hits += has_hit;
+		}
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	std::cout << rays.size() << " camera rays in " << seconds << "s, " << hits << " hits\n";
+	return rays.size() / seconds;
+}
+
+// Traces the scene in double and in single precision, first camera rays alone and then full renders,
+// and compares the throughput of the two and the error of the single precision image. A second
+// double precision render with another seed shows how much of that error is just sampling noise.
+inline void benchmark_precision(renderer settings, const camera& cam, const scene& sc, const basic_scene<float>& float_sc)
+{
+	settings = benchmark_settings(settings);
+
+	std::cout << "Double precision camera rays\n";
+	const double double_rate = packet_trace_rate(settings, cam, sc);
+	std::cout << "\nSingle precision camera rays\n";
+	const double float_rate = packet_trace_rate(settings, cam, float_sc);
+
+	renderer::render_stats stats;
+
+	std::cout << "\nDouble precision\n";
+	const renderer::image_buffer double_image = settings.render_image(cam, sc, stats);
+	const renderer::render_stats double_stats = stats;
+
+	std::cout << "\nSingle precision\n";
+	const renderer::image_buffer float_image = settings.render_image(cam, float_sc, stats);
+	const renderer::render_stats float_stats = stats;
+
+	std::cout << "\nDouble precision, another seed\n";
+	renderer reseeded = settings;
+	reseeded.seed = settings.seed + 1;
+	const renderer::image_buffer reseeded_image = reseeded.render_image(cam, sc, stats);
+
+	auto rays_per_second = [&](const renderer::render_stats& stats) { return stats.rays_per_pixel * settings.image_width * settings.image_height / stats.seconds; };
+	std::cout << "\nCamera rays: double " << double_rate / 1e6 << " Mrays/s, single " << float_rate / 1e6 << " Mrays/s, " << float_rate / double_rate << "x\n";
+	std::cout << "Renders:     double " << rays_per_second(double_stats) / 1e6 << " Mrays/s, single " << rays_per_second(float_stats) / 1e6 << " Mrays/s, "
+		<< rays_per_second(float_stats) / rays_per_second(double_stats) << "x\n";
+	std::cout << "RMSE of single precision against double " << image_rmse(float_image, double_image) << ", of another double precision seed " << image_rmse(reseeded_image, double_image) << '\n';
+}
+
+// Returns false if there is no benchmark with that name. add_float_objects fills an empty single
+// precision scene with the objects of sc, for the benchmarks that compare precisions.
+inline bool run_benchmark(std::string_view name, const renderer& settings, const camera& cam, const scene& sc, const std::function<void(basic_scene<float>&)>& add_float_objects)
+{
+	if (name == "russian_roulette")
+	{
+		benchmark_russian_roulette(settings, cam, sc);
+		return true;
+	}
+	if (name == "next_event_estimation")
+	{
+		benchmark_next_event_estimation(settings, cam, sc);
+		return true;
+	}
+	if (name == "samplers")
+	{
+		benchmark_samplers(settings, cam, sc);
+		return true;
+	}
+	if (name == "environment")
+	{
+		benchmark_environment(sc);
+		return true;
+	}
+	if (name == "mip_maps")
+	{
+		benchmark_mip_maps(settings, cam, sc);
+		return true;
+	}
+	if (name == "texture_layout")
+	{
+		benchmark_texture_layout();
+		return true;
+	}
+	if (name == "half_textures")
+	{
+		benchmark_half_textures();
+		return true;
+	}
+	if (name == "texture_cache")
+	{
+		benchmark_texture_cache();
+		return true;
+	}
+	if (name == "random")
+	{
+		benchmark_random();
+		return true;
+	}
+	if (name == "ray_packets")
+	{
+		benchmark_ray_packets(settings, cam, sc);
+		return true;
+	}
+	if (name == "occlusion")
+	{
+		benchmark_occlusion(settings, cam, sc);
+		return true;
+	}
+	if (name == "bvh_build")
+	{
+		benchmark_bvh_build();
+		return true;
+	}
+	if (name == "sphere_set")
+	{
+		benchmark_sphere_set(settings, cam, sc);
+		return true;
+	}
+	if (name == "instances")
+	{
+		benchmark_instances(settings, cam, sc);
+		return true;
+	}
+	if (name == "mesh_sides")
+	{
+		benchmark_mesh_sides(settings, cam, sc);
+		return true;
+	}
+	if (name == "precision")
+	{
+		basic_scene<float> float_sc = { .sky_material = sc.sky_material };
+		add_float_objects(float_sc);
+		benchmark_precision(settings, cam, sc, float_sc);
+		return true;
+	}
+
+	std::cerr << "Unknown benchmark " << name << ", expected one of: russian_roulette, next_event_estimation, samplers, environment, mip_maps, texture_layout, half_textures, texture_cache, random, ray_packets, occlusion, mesh_sides, bvh_build, sphere_set, instances, precision\n";
+	return false;
+}
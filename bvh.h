@@ -0,0 +1,565 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "aabb.h"
+#include "ray.h"
+#include "task_scheduler.h"
+
+// Bounding volume hierarchy over a list of primitives given only by their bounding boxes.
+// Nodes are stored in one flat array with the two children of a node next to each other,
+// and the leaves refer to ranges of primitive_indices, so the BVH doesn't care what the primitives are:
+// the owner intersects them through the callback passed to traverse().
+// Bounds and traversal are in the precision of T.
+template <typename T>
+class basic_bvh
+{
+public:
+	using aabb = basic_aabb<T>;
+	using vec3 = vec3_t<T>;
+	using vec4 = typename vector_types<T>::vec4;
+	using packet = typename vector_types<T>::packet;
+
+	struct node
+	{
+		aabb bounds;
+		int first; // Leaf: first entry in primitive_indices. Interior: index of the left child, the right child follows it.
+		int count; // Leaf: number of primitives. Interior: 0.
+
+		bool is_leaf() const
+		{
+			return count > 0;
+		}
+	};
+
+	// Statistics about the last build, SAH cost is the expected cost of tracing a ray that hits the root
+	// in units of one primitive intersection, with a node visit costing traversal_cost
+	struct build_stats
+	{
+		double seconds = 0;
+		double sah_cost = 0;
+		int node_count = 0;
+		int leaf_count = 0;
+		int depth = 0;
+		int largest_leaf = 0;
+		double average_leaf_size = 0;
+	};
+
+	static constexpr int max_leaf_size = 16; // Nodes up to this size become leaves when splitting them costs more, or they can't be split
+	static constexpr double traversal_cost = 1.0; // Cost of visiting a node relative to intersecting one primitive
+
+	// Binned SAH build. Nodes with at least parallel_build_threshold primitives are handed to a
+	// work-stealing pool of num_threads workers (0 for every hardware thread), smaller ones are
+	// built recursively by the worker that split them off.
+	build_stats build(std::span<const aabb> primitive_bounds, int num_threads = 0)
+	{
+		const auto start_time = std::chrono::steady_clock::now();
+
+		nodes.clear();
+		primitive_indices.clear();
+
+		// Work on a copy of the bounds that gets partitioned along with the indices, so every node
+		// reads its primitives from one contiguous range. Primitives with empty bounds can't be hit and are left out.
+		std::vector<build_primitive> primitives;
+		primitives.reserve(primitive_bounds.size());
+		build_task root = { 0, 0, 0, 0 };
+		for (int i = 0; i < (int)primitive_bounds.size(); ++i)
+		{
+			if (primitive_bounds[i].is_empty())
+				continue;
+
+			primitives.push_back({ primitive_bounds[i], i });
+			root.bounds.grow(primitive_bounds[i]);
+			root.centre_bounds.grow(primitive_bounds[i].centre());
+		}
+		root.count = (int)primitives.size();
+		if (primitives.empty())
+			return {};
+
+		// Every split allocates a pair of nodes, so a tree over n primitives never needs more than 2n - 1
+		nodes.resize(primitives.size() * 2 - 1);
+		std::atomic<int> node_count = 1;
+		const builder b = { primitives, node_count };
+
+		const int thread_count = num_threads > 0 ? num_threads : (int)std::thread::hardware_concurrency();
+		if (thread_count <= 1 || root.count < parallel_build_threshold)
+		{
+			build_node(b, root);
+		}
+		else
+		{
+			work_stealing_scheduler<build_task> scheduler(thread_count);
+			scheduler.push(0, root);
+			scheduler.run([&](const build_task& task, work_stealing_scheduler<build_task>::context& ctx)
+				{
+					for (const build_task& child : split_node(b, task))
+					{
+						if (child.count >= parallel_build_threshold)
+							ctx.push(child);
+						else if (child.count > 0)
+							build_node(b, child);
+					}
+				});
+		}
+		nodes.resize(node_count);
+
+		primitive_indices.resize(primitives.size());
+		std::transform(primitives.begin(), primitives.end(), primitive_indices.begin(), [](const build_primitive& primitive) { return primitive.index; });
+
+		build_stats stats = compute_stats();
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		return stats;
+	}
+
+	bool empty() const
+	{
+		return nodes.empty();
+	}
+
+	const aabb& bounds() const
+	{
+		return nodes.front().bounds;
+	}
+
+	// Index of every primitive in the tree in the order the leaves reference them, which keeps primitives
+	// that are close in space close together
+	std::span<const int> primitive_order() const
+	{
+		return primitive_indices;
+	}
+
+	// Visits the leaves the ray passes through within [t_min, t_max], nearest first, calling
+	// intersect(primitive_index, t_max) for each of their primitives. On a hit the callback
+	// lowers t_max to the hit distance, which culls every node behind it.
+	template<typename intersect_fn>
+	void traverse(const basic_ray<T>& r, T t_min, T t_max, intersect_fn&& intersect) const
+	{
+		if (nodes.empty())
+			return;
+
+		const vec3 inv_direction = vec3(1, 1, 1) / r.direction;
+
+		struct stack_entry
+		{
+			int node;
+			T entry; // Distance the ray enters the node's bounds
+		};
+		stack_entry stack[max_depth];
+		int stack_size = 0;
+		int current = 0;
+
+		if (nodes[0].bounds.ray_entry(r.origin, inv_direction, t_min, t_max) == std::numeric_limits<T>::infinity())
+			return;
+
+		while (true)
+		{
+			const node& n = nodes[current];
+			if (n.is_leaf())
+			{
+				for (int i = n.first; i < n.first + n.count; ++i)
+				{
+					intersect(primitive_indices[i], t_max);
+				}
+			}
+			else
+			{
+				T entry_left = nodes[n.first].bounds.ray_entry(r.origin, inv_direction, t_min, t_max);
+				T entry_right = nodes[n.first + 1].bounds.ray_entry(r.origin, inv_direction, t_min, t_max);
+				int near_child = n.first;
+				int far_child = n.first + 1;
+				if (entry_right < entry_left)
+				{
+					std::swap(entry_left, entry_right);
+					std::swap(near_child, far_child);
+				}
+
+				if (entry_left != std::numeric_limits<T>::infinity())
+				{
+					if (entry_right != std::numeric_limits<T>::infinity())
+					{
+						stack[stack_size++] = { far_child, entry_right };
+					}
+					current = near_child;
+					continue;
+				}
+			}
+
+			// Pop the next node, skipping ones the ray only reaches beyond the closest hit found since they were pushed
+			do
+			{
+				if (stack_size == 0)
+					return;
+				--stack_size;
+			} while (stack[stack_size].entry > t_max);
+			current = stack[stack_size].node;
+		}
+	}
+
+	// Any-hit version of traverse: visits the leaves the ray passes through within [t_min, t_max], calling
+	// occluded(primitive_index) for each of their primitives until one returns true. The range never shrinks,
+	// so children are taken in whatever order and none are skipped. Returns whether a primitive was hit.
+	template<typename occluded_fn>
+	bool traverse_any(const basic_ray<T>& r, T t_min, T t_max, occluded_fn&& occluded) const
+	{
+		if (nodes.empty())
+			return false;
+
+		const vec3 inv_direction = vec3(1, 1, 1) / r.direction;
+
+		int stack[max_depth];
+		int stack_size = 0;
+		int current = 0;
+
+		if (nodes[0].bounds.ray_entry(r.origin, inv_direction, t_min, t_max) == std::numeric_limits<T>::infinity())
+			return false;
+
+		while (true)
+		{
+			const node& n = nodes[current];
+			if (n.is_leaf())
+			{
+				for (int i = n.first; i < n.first + n.count; ++i)
+				{
+					if (occluded(primitive_indices[i]))
+						return true;
+				}
+			}
+			else
+			{
+				const bool hit_left = nodes[n.first].bounds.ray_entry(r.origin, inv_direction, t_min, t_max) != std::numeric_limits<T>::infinity();
+				const bool hit_right = nodes[n.first + 1].bounds.ray_entry(r.origin, inv_direction, t_min, t_max) != std::numeric_limits<T>::infinity();
+				if (hit_left && hit_right)
+				{
+					stack[stack_size++] = n.first + 1;
+				}
+				if (hit_left || hit_right)
+				{
+					current = hit_left ? n.first : n.first + 1;
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+				return false;
+			current = stack[--stack_size];
+		}
+	}
+
+	// Packet version of traverse: visits every leaf any of the rays passes through, calling
+	// intersect(primitive_index, t_max) with each ray's current range in t_max, which the callback
+	// lowers for the rays that hit. Children are visited in the order most rays enter them.
+	template<typename intersect_fn>
+	void traverse(const basic_ray_packet<T>& rays, T t_min, packet& t_max, intersect_fn&& intersect) const
+	{
+		if (nodes.empty())
+			return;
+
+		const packet inv_direction[3] = { packet(1) / rays.direction[0], packet(1) / rays.direction[1], packet(1) / rays.direction[2] };
+		const packet miss = std::numeric_limits<T>::infinity();
+
+		struct stack_entry
+		{
+			packet entry; // Distance each ray enters the node's bounds
+			int node;
+		};
+		stack_entry stack[max_depth];
+		int stack_size = 0;
+		int current = 0;
+
+		if (horizontal_and(nodes[0].bounds.ray_entry(rays.origin, inv_direction, t_min, t_max) == miss))
+			return;
+
+		while (true)
+		{
+			const node& n = nodes[current];
+			if (n.is_leaf())
+			{
+				for (int i = n.first; i < n.first + n.count; ++i)
+				{
+					intersect(primitive_indices[i], t_max);
+				}
+			}
+			else
+			{
+				packet entry_left = nodes[n.first].bounds.ray_entry(rays.origin, inv_direction, t_min, t_max);
+				packet entry_right = nodes[n.first + 1].bounds.ray_entry(rays.origin, inv_direction, t_min, t_max);
+				const bool hit_left = !horizontal_and(entry_left == miss);
+				const bool hit_right = !horizontal_and(entry_right == miss);
+				int near_child = n.first;
+				int far_child = n.first + 1;
+				if (hit_left && hit_right)
+				{
+					if (horizontal_count(entry_right < entry_left) > horizontal_count(entry_left < entry_right))
+					{
+						std::swap(entry_left, entry_right);
+						std::swap(near_child, far_child);
+					}
+					stack[stack_size++] = { entry_right, far_child };
+					current = near_child;
+					continue;
+				}
+				if (hit_left || hit_right)
+				{
+					current = hit_left ? near_child : far_child;
+					continue;
+				}
+			}
+
+			// Pop the next node, skipping ones every ray only reaches beyond its closest hit
+			do
+			{
+				if (stack_size == 0)
+					return;
+				--stack_size;
+			} while (horizontal_and(stack[stack_size].entry > t_max));
+			current = stack[stack_size].node;
+		}
+	}
+
+private:
+	static constexpr int bin_count = 16;
+	static constexpr int parallel_build_threshold = 4096;
+	static constexpr int max_depth = 128;     // Bound on the traversal stack
+	static constexpr int max_sah_depth = 96;  // Beyond this, median splits keep the remaining depth within log2(n)
+
+	struct build_primitive
+	{
+		aabb bounds;
+		int index;
+	};
+
+	struct build_task
+	{
+		int node_index;
+		int first; // Range of primitives under the node
+		int count;
+		int depth;
+		aabb bounds;        // Of the primitives
+		aabb centre_bounds; // Of their centres
+	};
+
+	static Vec4i truncate_bins(const Vec4d& bins)
+	{
+		return truncate_to_int32(bins);
+	}
+
+	static Vec4i truncate_bins(const Vec4f& bins)
+	{
+		return truncatei(bins);
+	}
+
+	struct builder
+	{
+		std::span<build_primitive> primitives;
+		std::atomic<int>& node_count;
+	};
+
+	void build_node(const builder& b, const build_task& task)
+	{
+		for (const build_task& child : split_node(b, task))
+		{
+			if (child.count > 0)
+				build_node(b, child);
+		}
+	}
+
+	// Sets up the node for the task and returns its two children, or two empty tasks if it became a leaf
+	std::array<build_task, 2> split_node(const builder& b, const build_task& task)
+	{
+		const std::span<build_primitive> primitives = b.primitives.subspan(task.first, task.count);
+		const int count = task.count;
+
+		node& n = nodes[task.node_index];
+		n.bounds = task.bounds;
+
+		auto make_leaf = [&]() -> std::array<build_task, 2>
+		{
+			n.first = task.first;
+			n.count = count;
+			return {};
+		};
+
+		if (count == 1)
+			return make_leaf();
+
+		const vec3 extent = task.centre_bounds.extent();
+		const int longest_axis = extent[0] >= extent[1] && extent[0] >= extent[2] ? 0 : extent[1] >= extent[2] ? 1 : 2;
+
+		// Primitives whose centre lies below split_position on split_axis go to the left child. Without a
+		// usable plane the range is split in half by position instead.
+		int split_axis = longest_axis;
+		T split_position = 0;
+		bool split_in_half = false;
+
+		if (extent[longest_axis] <= 0)
+		{
+			// Every centre coincides so there's nothing to bin, split the range in half if it's too big for a leaf
+			if (count <= max_leaf_size)
+				return make_leaf();
+			split_in_half = true;
+		}
+		else if (task.depth >= max_sah_depth)
+		{
+			std::nth_element(primitives.begin(), primitives.begin() + count / 2, primitives.end(),
+				[&](const build_primitive& a, const build_primitive& c) { return a.bounds.centre()[longest_axis] < c.bounds.centre()[longest_axis]; });
+			split_position = primitives[count / 2].bounds.centre()[longest_axis];
+		}
+		else
+		{
+			// Bin the centres along all three axes at once, then sweep each axis's bins from both ends for the cheapest split plane.
+			// Small nodes use fewer bins, which is where most of the nodes and most of the sweeping are.
+			const int num_bins = std::min(count, bin_count);
+			struct bin
+			{
+				aabb bounds;
+				int count = 0;
+			};
+			bin bins[3][bin_count];
+
+			const vec4 centre_min = task.centre_bounds.min.to_vector();
+			const vec4 bin_scale = select(extent.to_vector() > 0, vec4(T(num_bins)) / extent.to_vector(), vec4(0));
+			for (const build_primitive& primitive : primitives)
+			{
+				const Vec4i k = min(truncate_bins((primitive.bounds.centre().to_vector() - centre_min) * bin_scale), Vec4i(num_bins - 1));
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					bins[axis][k[axis]].bounds.grow(primitive.bounds);
+					++bins[axis][k[axis]].count;
+				}
+			}
+
+			double best_cost = std::numeric_limits<double>::infinity();
+			int best_axis = 0;
+			int best_bin = 0;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				if (extent[axis] <= 0)
+					continue;
+
+				double right_area[bin_count];
+				int right_count[bin_count];
+				aabb right_bounds;
+				int right_total = 0;
+				for (int k = num_bins - 1; k > 0; --k)
+				{
+					right_bounds.grow(bins[axis][k].bounds);
+					right_total += bins[axis][k].count;
+					right_area[k] = right_bounds.surface_area();
+					right_count[k] = right_total;
+				}
+
+				aabb left_bounds;
+				int left_total = 0;
+				for (int k = 1; k < num_bins; ++k)
+				{
+					left_bounds.grow(bins[axis][k - 1].bounds);
+					left_total += bins[axis][k - 1].count;
+					const double cost = left_bounds.surface_area() * left_total + right_area[k] * right_count[k];
+					if (left_total > 0 && right_count[k] > 0 && cost < best_cost)
+					{
+						best_cost = cost;
+						best_axis = axis;
+						best_bin = k;
+					}
+				}
+			}
+
+			const double parent_area = task.bounds.surface_area();
+			const double split_cost = traversal_cost + (parent_area > 0 ? best_cost / parent_area : 0);
+			if (count <= max_leaf_size && count <= split_cost)
+				return make_leaf();
+
+			split_axis = best_axis;
+			split_position = task.centre_bounds.min[best_axis] + best_bin / bin_scale[best_axis];
+		}
+
+		// Partition the range, gathering the bounds each child needs on the way
+		build_task left = { 0, task.first, 0, task.depth + 1 };
+		build_task right = { 0, 0, 0, task.depth + 1 };
+		auto partition = [&]()
+		{
+			left.bounds = left.centre_bounds = right.bounds = right.centre_bounds = aabb();
+			int i = 0;
+			int j = count - 1;
+			while (i <= j)
+			{
+				const bool goes_left = split_in_half ? i < count / 2 : primitives[i].bounds.centre()[split_axis] < split_position;
+				if (goes_left)
+				{
+					left.bounds.grow(primitives[i].bounds);
+					left.centre_bounds.grow(primitives[i].bounds.centre());
+					++i;
+				}
+				else
+				{
+					std::swap(primitives[i], primitives[j]);
+					right.bounds.grow(primitives[j].bounds);
+					right.centre_bounds.grow(primitives[j].bounds.centre());
+					--j;
+				}
+			}
+			left.count = i;
+			right.first = task.first + i;
+			right.count = count - i;
+		};
+		partition();
+
+		// Rounding can put every centre on one side of a binned plane
+		if (left.count == 0 || right.count == 0)
+		{
+			if (count <= max_leaf_size)
+				return make_leaf();
+			split_in_half = true;
+			partition();
+		}
+
+		left.node_index = b.node_count.fetch_add(2, std::memory_order_relaxed);
+		right.node_index = left.node_index + 1;
+		n.first = left.node_index;
+		n.count = 0;
+		return { left, right };
+	}
+
+	// Children are always allocated after their parent, so one pass in index order sees every node after its parent
+	build_stats compute_stats() const
+	{
+		build_stats stats;
+		stats.node_count = (int)nodes.size();
+
+		const double root_area = nodes[0].bounds.surface_area();
+		std::vector<int> depths(nodes.size(), 0);
+		long long leaf_primitives = 0;
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			const node& n = nodes[i];
+			const double relative_area = root_area > 0 ? n.bounds.surface_area() / root_area : 1.0;
+			stats.depth = std::max(stats.depth, depths[i]);
+			if (n.is_leaf())
+			{
+				stats.sah_cost += relative_area * n.count;
+				++stats.leaf_count;
+				stats.largest_leaf = std::max(stats.largest_leaf, n.count);
+				leaf_primitives += n.count;
+			}
+			else
+			{
+				stats.sah_cost += relative_area * traversal_cost;
+				depths[n.first] = depths[n.first + 1] = depths[i] + 1;
+			}
+		}
+		stats.average_leaf_size = (double)leaf_primitives / stats.leaf_count;
+		return stats;
+	}
+
+	std::vector<node> nodes;
+	std::vector<int> primitive_indices;
+};
+
+using bvh = basic_bvh<double>;
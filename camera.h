@@ -1,9 +1,56 @@
 #pragma once
 
 #include "common/vectorclass/vector3d.h"
+#include "ray.h"
 
 struct camera
 {
     Vec3Dd origin = Vec3Dd(0, 0, 0);
     double focal_length = 1.0;
 };
+
+// Maps positions on an image of the given size, in pixels from the top left corner, to rays from the camera
+// in the precision of T
+template <typename T>
+struct basic_camera_viewport
+{
+    using vec3 = vec3_t<T>;
+
+    basic_camera_viewport(const camera& cam, int image_width, int image_height)
+        : origin(convert_vector<T>(cam.origin))
+    {
+        const double aspect_ratio = static_cast<double>(image_width) / image_height;
+
+        // Determine viewport dimensions.
+        constexpr auto viewport_height = 2.0;
+        const auto viewport_width = viewport_height * aspect_ratio;
+
+        // Calculate the vectors across the horizontal and down the vertical viewport edges.
+        const auto viewport_u = Vec3Dd(viewport_width, 0, 0);
+        const auto viewport_v = Vec3Dd(0, -viewport_height, 0);
+
+        // Calculate the horizontal and vertical delta vectors from pixel to pixel.
+        pixel_delta_u = convert_vector<T>(viewport_u / image_width);
+        pixel_delta_v = convert_vector<T>(viewport_v / image_height);
+
+        // Calculate the location of the upper left pixel.
+        viewport_upper_left = convert_vector<T>(cam.origin + Vec3Dd(0, 0, cam.focal_length) - viewport_u / 2 - viewport_v / 2);
+    }
+
+    // The ray's cone spreads cone_scale pixels wide per pixel of distance to the viewport, 0 for no cone
+    basic_ray<T> primary_ray(double x, double y, int recursion_depth, double cone_scale = 0) const
+    {
+        auto pixel_center = viewport_upper_left + ((T)x * pixel_delta_u) + ((T)y * pixel_delta_v);
+        auto ray_direction = pixel_center - origin;
+        basic_ray<T> result(origin, ray_direction, recursion_depth);
+        result.cone_spread = (float)(cone_scale * std::sqrt(dot_product(pixel_delta_u, pixel_delta_u) / dot_product(ray_direction, ray_direction)));
+        return result;
+    }
+
+    vec3 origin;
+    vec3 viewport_upper_left;
+    vec3 pixel_delta_u;
+    vec3 pixel_delta_v;
+};
+
+using camera_viewport = basic_camera_viewport<double>;
@@ -1,30 +1,35 @@
 #pragma once
 
+#include <array>
+#include <span>
+
 #include "colour.h"
 #include "scalarmath.h"
+#include "../vectorclass/vectorclass.h"
+#include "../vectorclass/vectormath_exp.h"
 
 constexpr uint8_t sRGB_limit_u8 = (uint8_t)10; // (0.04045 * 255) = 10.31475
 
-fRGBA sRGB_to_linear(RGBA sRGB_colour)
+// Linear value of each 8-bit sRGB value, so decoding 8-bit colours is a lookup per channel
+inline const std::array<float, 256> sRGB_u8_to_linear = []()
 {
-	fRGBA colour(sRGB_colour.R/255.f, sRGB_colour.G/255.f, sRGB_colour.B/255.f, sRGB_colour.A/255.f);
+	std::array<float, 256> table;
+	for (int i = 0; i < 256; ++i)
+	{
+		const float value = i / 255.f;
+		table[i] = i <= sRGB_limit_u8 ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+	}
+	return table;
+}();
 
-	colour.R = sRGB_colour.R <= sRGB_limit_u8 ? colour.R / 12.92f : std::pow((colour.R + 0.055f) / 1.055f, 2.4f);
-	colour.G = sRGB_colour.G <= sRGB_limit_u8 ? colour.G / 12.92f : std::pow((colour.G + 0.055f) / 1.055f, 2.4f);
-	colour.B = sRGB_colour.B <= sRGB_limit_u8 ? colour.B / 12.92f : std::pow((colour.B + 0.055f) / 1.055f, 2.4f);
-
-	return colour;
+fRGBA sRGB_to_linear(RGBA sRGB_colour)
+{
+	return fRGBA(sRGB_u8_to_linear[sRGB_colour.R], sRGB_u8_to_linear[sRGB_colour.G], sRGB_u8_to_linear[sRGB_colour.B], sRGB_colour.A / 255.f);
 }
 
 fRGBA sRGB_to_linear(BGRA sRGB_colour)
 {
-	fRGBA colour = (fRGBA)sRGB_colour;
-
-	colour.R = sRGB_colour.R <= sRGB_limit_u8 ? colour.R / 12.92f : std::pow((colour.R + 0.055f) / 1.055f, 2.4f);
-	colour.G = sRGB_colour.G <= sRGB_limit_u8 ? colour.G / 12.92f : std::pow((colour.G + 0.055f) / 1.055f, 2.4f);
-	colour.B = sRGB_colour.B <= sRGB_limit_u8 ? colour.B / 12.92f : std::pow((colour.B + 0.055f) / 1.055f, 2.4f);
-
-	return colour;
+	return fRGBA(sRGB_u8_to_linear[sRGB_colour.R], sRGB_u8_to_linear[sRGB_colour.G], sRGB_u8_to_linear[sRGB_colour.B], sRGB_colour.A / 255.f);
 }
 
 fRGBA sRGB_to_linear(fRGBA sRGB_colour)
@@ -38,15 +43,42 @@ fRGBA sRGB_to_linear(fRGBA sRGB_colour)
 	return colour;
 }
 
+// sRGB encoding of every channel of linear, which must be in [0, 1]
+template<typename vector_type>
+vector_type linear_to_sRGB_channels(vector_type linear)
+{
+	return select(linear <= 0.0031308f, linear * 12.92f, pow(linear, 1.0f / 2.4f) * 1.055f - 0.055f);
+}
+
 fRGBA linear_to_sRGB(fRGBA linear_colour)
 {
-	fRGBA colour = Saturate(linear_colour);
+	const Vec4f colour = min(max(Vec4f().load(&linear_colour.R), 0.0f), 1.0f);
 
-	colour.R = colour.R <= 0.0031308f ? colour.R * 12.92f : std::pow(colour.R, 1.0f / 2.4f) * 1.055f - 0.055f;
-	colour.G = colour.G <= 0.0031308f ? colour.G * 12.92f : std::pow(colour.G, 1.0f / 2.4f) * 1.055f - 0.055f;
-	colour.B = colour.B <= 0.0031308f ? colour.B * 12.92f : std::pow(colour.B, 1.0f / 2.4f) * 1.055f - 0.055f;
+	// Alpha stays linear
+	fRGBA result;
+	blend4<0, 1, 2, 7>(linear_to_sRGB_channels(colour), colour).store(&result.R);
+	return result;
+}
 
-	return colour;
+// linear_to_sRGB and the conversion to RGBA for a whole row or image, two colours at a time.
+// sRGB_colours must be as long as linear_colours.
+inline void linear_to_sRGB(std::span<const fRGBA> linear_colours, std::span<RGBA> sRGB_colours)
+{
+	size_t i = 0;
+	for (; i + 2 <= linear_colours.size(); i += 2)
+	{
+		const Vec8f colours = min(max(Vec8f().load(&linear_colours[i].R), 0.0f), 1.0f);
+		const Vec8f encoded = blend8<0, 1, 2, 11, 4, 5, 6, 15>(linear_to_sRGB_channels(colours), colours);
+
+		// Rounded to nearest even, like fRGBA's conversion to RGBA, and already in range for bytes
+		const Vec8i values = roundi(encoded * 255.0f);
+		const Vec16c bytes = compress(compress(values.get_low(), values.get_high()), Vec8s(0));
+		bytes.store_partial(8, &sRGB_colours[i]);
+	}
+	for (; i < linear_colours.size(); ++i)
+	{
+		sRGB_colours[i] = RGBA(linear_to_sRGB(linear_colours[i]));
+	}
 }
 
 template<typename colour_type_dest, typename colour_type_source>
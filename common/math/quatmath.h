@@ -1,6 +1,6 @@
 #pragma once
 
-#include "globaldefs.h"
+#include "mathcommon.h"
 #include "scalarmath.h"
 #include "vector_math.h"
 
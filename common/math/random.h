@@ -1,6 +1,7 @@
 #pragma once
 
 #include <random>
+#include <span>
 #include "common/pcg/pcg_random.hpp"
 #include "common/vectorclass/vector3d.h"
 
@@ -10,15 +11,112 @@ inline auto& rand_generator()
     return generator;
 }
 
-inline double random_double(double min, double max)
+// splitmix64 finaliser, turns related inputs (pixel coordinates, sample indices) into unrelated seeds
+inline uint64_t mix_seed(uint64_t a, uint64_t b)
+{
+    uint64_t z = a + 0x9e3779b97f4a7c15ull * (b + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Uniform doubles made in batches: four xoshiro256+ streams run side by side, one per lane of a Vec4uq,
+// and the top 52 bits of each output become the mantissa of a double in [1, 2), which less one is uniform
+// in [0, 1). Nothing is divided or converted, and a refill makes batch_size numbers at once.
+class batch_random_generator
+{
+public:
+    static constexpr int batch_size = 64;
+
+    batch_random_generator()
+    {
+        seed(0);
+    }
+
+    void seed(uint64_t seed)
+    {
+        uint64_t words[4][4];
+        for (int word = 0; word < 4; ++word)
+        {
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                words[word][lane] = mix_seed(seed, word * 4 + lane);
+            }
+            state[word].load(words[word]);
+        }
+        next_index = batch_size;
+    }
+
+    double next()
+    {
+        if (next_index == batch_size)
+            refill();
+        return batch[next_index++];
+    }
+
+    // Four numbers at once
+    Vec4d next4()
+    {
+        if (next_index > batch_size - 4)
+            refill();
+        const Vec4d result = Vec4d().load(&batch[next_index]);
+        next_index += 4;
+        return result;
+    }
+
+private:
+    void refill()
+    {
+        for (int i = 0; i < batch_size; i += 4)
+        {
+            const Vec4uq result = state[0] + state[3];
+            const Vec4uq t = state[1] << 17;
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = (state[3] << 45) | (state[3] >> 19);
+
+            (Vec4d(reinterpret_d((result >> 12) | 0x3FF0000000000000ull)) - 1.0).store(&batch[i]);
+        }
+        next_index = 0;
+    }
+
+    Vec4uq state[4]; // Word w of lane l's state is lane l of state[w]
+    alignas(32) double batch[batch_size];
+    int next_index;
+};
+
+inline auto& batch_generator()
 {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    return distribution(rand_generator(), std::uniform_real_distribution<double>::param_type(min, max));
+    static thread_local batch_random_generator generator;
+    return generator;
 }
 
 inline double random_double()
 {
-    return random_double(0.0, 1.0);
+    return batch_generator().next();
+}
+
+inline double random_double(double min, double max)
+{
+    return min + (max - min) * random_double();
+}
+
+// Four uniform numbers in [0, 1) in one vector
+inline Vec4d random_double4()
+{
+    return batch_generator().next4();
+}
+
+// Fills numbers with uniform numbers in [0, 1)
+inline void random_doubles(std::span<double> numbers)
+{
+    for (double& number : numbers)
+    {
+        number = batch_generator().next();
+    }
 }
 
 static Vec3Dd random3d(double min, double max)
@@ -31,10 +129,24 @@ static Vec3Dd random3d()
     return random3d(0.0, 1.0);
 }
 
+inline auto& gaussian_distribution()
+{
+    static thread_local std::normal_distribution<double> distribution;
+    return distribution;
+}
+
 inline double gaussian_double()
 {
-    static std::normal_distribution<double> distribution;
-    return distribution(rand_generator());
+    return gaussian_distribution()(rand_generator());
+}
+
+// Restarts the calling thread's random sequence from the given seed, for reproducible results
+inline void seed_random(uint64_t seed)
+{
+    using pcg_extras::pcg128_t;
+    rand_generator().seed(PCG_128BIT_CONSTANT(mix_seed(seed, 0), mix_seed(seed, 1)));
+    gaussian_distribution().reset();
+    batch_generator().seed(seed);
 }
 
 static Vec3Dd gaussian_3d()
@@ -42,15 +154,21 @@ static Vec3Dd gaussian_3d()
     return Vec3Dd(gaussian_double(), gaussian_double(), gaussian_double());
 }
 
+// Picks four points in the cube around the unit sphere at once and normalises the first inside the sphere,
+// which one of the four is 95% of the time
 inline Vec3Dd random_unit_vector()
 {
     do
     {
-        auto p = gaussian_3d();
+        const Vec4d x = random_double4() * 2 - 1;
+        const Vec4d y = random_double4() * 2 - 1;
+        const Vec4d z = random_double4() * 2 - 1;
+        const Vec4d length_squared = x * x + y * y + z * z;
+        const int lane = horizontal_find_first(length_squared <= 1 && length_squared > 1e-30);
         [[likely]]
-        if (p != Vec3Dd(0, 0, 0))
+        if (lane >= 0)
         {
-            return normalize_vector(p);
+            return Vec3Dd(x[lane], y[lane], z[lane]) / std::sqrt(length_squared[lane]);
         }
     } while (true);
 }
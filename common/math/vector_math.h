@@ -1,6 +1,6 @@
 #pragma once
 
-#include "globaldefs.h"
+#include "mathcommon.h"
 #include "scalarmath.h"
 
 struct alignstruct(16) Vector2
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+
+#include "common/math/matrixmath.h"
+#include "common/math/quatmath.h"
+
+#include "traceable.h"
+
+// Shared geometry placed in the scene with its own scale, rotation and translation, so an asset
+// repeated many times is stored once. Rays are moved into the geometry's object space to be traced,
+// so the scene BVH over instances and the geometry's own BVH make a two-level structure.
+template <typename T>
+class basic_instance : public basic_traceable<T>
+{
+public:
+    using aabb = basic_aabb<T>;
+    using vec3 = vec3_t<T>;
+    using packet = typename vector_types<T>::packet;
+
+    // Scales first, then rotates, then translates. material, unless -1, replaces the geometry's materials.
+    basic_instance(const std::shared_ptr<const basic_traceable<T>>& geometry, const Vector3& translation, const Quaternion& rotation = Quaternion(0, 0, 0, 1),
+        const Vector3& scale = Vector3(1, 1, 1), int material = -1)
+        : geometry(geometry), material(material)
+        , cone_scale((float)(1 / std::cbrt(std::abs(scale.x * scale.y * scale.z))))
+    {
+        object_to_world = transform(Matrix::ConstructScale(scale) * Matrix::ConstructFromQuaternion(rotation, translation));
+        world_to_object = transform(Matrix::ConstructTranslation(-translation) * Matrix::ConstructFromQuaternion(rotation.Conjugate()) * Matrix::ConstructScale(Vector3(1, 1, 1) / scale));
+    }
+
+    bool ray_intersect(const basic_ray<T>& r, T t_min, T t_max, basic_ray_intersection<T>& hit) const
+    {
+        // The direction isn't renormalised, so distances along the ray are the same in both spaces
+        if (!geometry->ray_intersect(to_object(r), t_min, t_max, hit))
+            return false;
+
+        to_world(hit, r);
+        return true;
+    }
+
+    bool occluded(const basic_ray<T>& r, T t_min, T t_max) const
+    {
+        return geometry->occluded(to_object(r), t_min, t_max);
+    }
+
+    packet ray_distances(const basic_ray_packet<T>& rays, T t_min, const packet& t_max) const
+    {
+        basic_ray<T> object_rays[basic_ray_packet<T>::size];
+        for (int i = 0; i < basic_ray_packet<T>::size; ++i)
+        {
+            object_rays[i] = to_object(rays.rays[i]);
+        }
+        basic_ray_packet<T> object_packet(object_rays);
+        object_packet.count = rays.count;
+        return geometry->ray_distances(object_packet, t_min, t_max);
+    }
+
+    void make_intersection(const basic_ray<T>& r, T t_min, T t, basic_ray_intersection<T>& hit) const
+    {
+        geometry->make_intersection(to_object(r), t_min, t, hit);
+        to_world(hit, r);
+    }
+
+    aabb bounds() const
+    {
+        const aabb object_bounds = geometry->bounds();
+        if (object_bounds.is_empty())
+            return object_bounds;
+
+        aabb result;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            const vec3 point((corner & 1 ? object_bounds.max : object_bounds.min).get_x(),
+                             (corner & 2 ? object_bounds.max : object_bounds.min).get_y(),
+                             (corner & 4 ? object_bounds.max : object_bounds.min).get_z());
+            result.grow(object_to_world.point(point));
+        }
+        return result;
+    }
+
+public:
+    std::shared_ptr<const basic_traceable<T>> geometry;
+    int material; // Index into the scene's materials, or -1
+
+private:
+    // Affine transform of row vectors, v * M, taken from a Matrix in the precision of T
+    struct transform
+    {
+        transform() = default;
+
+        explicit transform(const Matrix& m)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                rows[i] = vec3(m.v[i].x, m.v[i].y, m.v[i].z);
+            }
+        }
+
+        vec3 vector(const vec3& v) const
+        {
+            return v.get_x() * rows[0] + v.get_y() * rows[1] + v.get_z() * rows[2];
+        }
+
+        vec3 point(const vec3& p) const
+        {
+            return vector(p) + rows[3];
+        }
+
+        // Normals go through the transpose of the inverse, so this is called on the inverse transform
+        vec3 normal(const vec3& n) const
+        {
+            return vec3(dot_product(rows[0], n), dot_product(rows[1], n), dot_product(rows[2], n));
+        }
+
+        vec3 rows[4];
+    };
+
+    basic_ray<T> to_object(const basic_ray<T>& r) const
+    {
+        basic_ray<T> result = r;
+        result.origin = world_to_object.point(r.origin);
+        result.direction = world_to_object.vector(r.direction);
+        // The cone's angle is the same in object space, its width is scaled with the geometry
+        result.cone_width *= cone_scale;
+        return result;
+    }
+
+    void to_world(basic_ray_intersection<T>& hit, const basic_ray<T>& r) const
+    {
+        hit.location = r.at(hit.t);
+        hit.normal = normalize_vector(world_to_object.normal(hit.normal));
+        if (material >= 0)
+            hit.material = material;
+    }
+
+    transform object_to_world;
+    transform world_to_object;
+    float cone_scale; // Object space size of a unit of world space, the average over the axes for non-uniform scales
+};
+
+using instance = basic_instance<double>;
@@ -1,28 +1,52 @@
 #include <iostream>
 #include <numbers>
 
+#include "benchmark.h"
 #include "renderer.h"
 #include "scene.h"
 #include "sphere.h"
+#include "triangle_mesh.h"
 #include "texture.h"
 #include "material.h"
 
-std::shared_ptr sky_material = std::make_shared<basic_sky_texture_material>(std::make_shared<texture2d<fRGBA>>("probe_10-00_latlongmap.hdr", false, true));
+std::shared_ptr sky_material = std::make_shared<basic_sky_texture_material>(std::make_shared<texture2d<hRGBA>>("probe_10-00_latlongmap.hdr", false, true, false));
 
 auto material_ground = std::make_shared<basic_colour_material>(fRGBA(0.8f, 0.8f, 0.0f));
 auto material_center = std::make_shared<basic_colour_material>(fRGBA(0.1f, 0.2f, 0.5f));
 auto material_left   = std::make_shared<basic_dialectric_material>(1.5);
 auto material_right  = std::make_shared<basic_metal_material>(fRGBA(0.8f, 0.6f, 0.2f));
 
-std::shared_ptr ground = std::make_shared<sphere>(Vec3Dd{ 0.0, -100, 1.0}, 100, material_ground);
-std::shared_ptr center = std::make_shared<sphere>(Vec3Dd{ 0.0,  0.5, 1.0}, 0.5, material_center);
-std::shared_ptr left   = std::make_shared<sphere>(Vec3Dd{-1.0,  0.5, 1.0}, 0.5, material_left);
-std::shared_ptr left2  = std::make_shared<sphere>(Vec3Dd{-1.0,  0.5, 1.0}, -0.4, material_left);
-std::shared_ptr right  = std::make_shared<sphere>(Vec3Dd{ 1.0,  0.5, 1.0}, 0.5, material_right);
+// The scene's spheres and the meshes given on the command line, traced in the precision of T
+template <typename T>
+void add_scene_objects(basic_scene<T>& sc, std::span<const char* const> mesh_files)
+{
+	const int ground_index = sc.add_material(material_ground);
+	const int center_index = sc.add_material(material_center);
+	const int left_index   = sc.add_material(material_left);
+	const int right_index  = sc.add_material(material_right);
+
+	std::shared_ptr ground = std::make_shared<basic_sphere<T>>(Vec3Dd{ 0.0, -100, 1.0}, 100, ground_index);
+	std::shared_ptr center = std::make_shared<basic_sphere<T>>(Vec3Dd{ 0.0,  0.5, 1.0}, 0.5, center_index);
+	std::shared_ptr left   = std::make_shared<basic_sphere<T>>(Vec3Dd{-1.0,  0.5, 1.0}, 0.5, left_index);
+	std::shared_ptr left2  = std::make_shared<basic_sphere<T>>(Vec3Dd{-1.0,  0.5, 1.0}, -0.4, left_index);
+	std::shared_ptr right  = std::make_shared<basic_sphere<T>>(Vec3Dd{ 1.0,  0.5, 1.0}, 0.5, right_index);
+	sc.objects.insert(sc.objects.end(), { ground, center, left, left2, right });
 
-scene sc = {.objects = {ground, center, left, left2, right}, .sky_material = sky_material };
+	for (const char* mesh_file : mesh_files)
+	{
+		sc.objects.push_back(std::make_shared<basic_triangle_mesh<T>>(mesh_file, center_index));
+	}
+}
 
-int main()
+template <typename T>
+void render_scene(renderer& render, const camera& cam, std::span<const char* const> mesh_files)
+{
+	basic_scene<T> sc = { .sky_material = sky_material };
+	add_scene_objects(sc, mesh_files);
+	render.render(cam, sc);
+}
+
+int main(int argc, char* argv[])
 {
 	camera cam = { Vec3Dd(0, 0.5, 0), 1.0 };
 
@@ -36,7 +60,48 @@ int main()
 #endif
 	render.recursion_depth = 100;
 
-	render.render(cam, sc);
+	// --mesh <file.obj> adds a mesh to the scene, --benchmark <name> runs a benchmark instead of the render,
+	// --precision float traces the render in single precision rather than double
+	std::vector<const char*> mesh_files;
+	const char* benchmark = nullptr;
+	bool single_precision = false;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		const std::string_view option = argv[i];
+		const std::string_view value = argv[i + 1];
+		if (option == "--mesh")
+		{
+			mesh_files.push_back(argv[i + 1]);
+		}
+		else if (option == "--benchmark")
+		{
+			benchmark = argv[i + 1];
+		}
+		else if (option == "--precision" && (value == "float" || value == "double"))
+		{
+			single_precision = value == "float";
+		}
+		else
+		{
+			std::cerr << "Unknown option " << option << ", expected --mesh <file.obj>, --benchmark <name> or --precision <float|double>\n";
+			return 1;
+		}
+	}
+
+	if (benchmark)
+	{
+		scene sc = { .sky_material = sky_material };
+		add_scene_objects(sc, mesh_files);
+
+		// The single precision copy is only built by the benchmarks that compare precisions
+		auto add_float_objects = [&](basic_scene<float>& float_sc) { add_scene_objects(float_sc, mesh_files); };
+		return run_benchmark(benchmark, render, cam, sc, add_float_objects) ? 0 : 1;
+	}
+
+	if (single_precision)
+		render_scene<float>(render, cam, mesh_files);
+	else
+		render_scene<double>(render, cam, mesh_files);
 
 	std::cerr << "\nDone.\n";
 }
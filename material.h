@@ -3,13 +3,81 @@
 #include "common/mdspan/mdarray"
 #include "common/vectorclass/vector3d.h"
 #include "common/math/colour.h"
+#include "common/math/random.h"
 
+#include <numeric>
+#include <optional>
+#include <span>
+
+#include "alias_table.h"
+#include "octahedral_map.h"
+#include "ray.h"
+#include "sampler.h"
 #include "texture.h"
 
+struct scatter_record
+{
+	fRGBA attenuation;
+	ray scattered;
+	double pdf = 0; // Solid angle pdf of the scattered direction, 0 if it was the only one possible (a delta BSDF)
+};
+
+// Materials are BSDF-style: rather than tracing the rest of the path themselves they return how a hit
+// scatters, and the integrator in scene::ray_colour carries the path throughput from bounce to bounce.
 struct material
 {
 	virtual ~material() {}
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const = 0;
+
+	// Light leaving the surface back along r, the ray that hit it at ri
+	virtual fRGBA emitted(const ray& r, const ray_intersection& ri) const
+	{
+		return fRGBA(0, 0, 0, 0);
+	}
+
+	// emitted() for many rays that hit nothing at once, which only sky materials are asked for.
+	// colours must be as long as directions.
+	virtual void sky_emitted(std::span<const Vec3Dd> directions, std::span<fRGBA> colours) const
+	{
+		for (size_t i = 0; i < directions.size(); ++i)
+		{
+			colours[i] = emitted(ray{ Vec3Dd(0, 0, 0), directions[i], 0 }, ray_intersection{});
+		}
+	}
+
+	// The colour the rest of the path is attenuated by and the ray it continues along, nothing if the path is absorbed.
+	// Draws at most one dimension from s.
+	virtual std::optional<scatter_record> scatter(const ray& r, const ray_intersection& ri, sampler& s) const
+	{
+		return std::nullopt;
+	}
+
+	// Whether evaluate() can be nonzero, so next-event estimation has anything to light. False for delta BSDFs.
+	virtual bool has_diffuse_lobe() const
+	{
+		return false;
+	}
+
+	// For next-event estimation: the BSDF times the cosine term for light arriving at ri from direction,
+	// and the pdf scatter() would pick that direction with
+	virtual fRGBA evaluate(const ray& r, const ray_intersection& ri, const Vec3Dd& direction, double& pdf) const
+	{
+		pdf = 0;
+		return fRGBA(0, 0, 0, 0);
+	}
+
+	// For lights next-event estimation can sample: a direction picked roughly in proportion to the light
+	// emitted along it and its solid angle pdf, or false if the material can't be sampled. Draws at most one
+	// dimension from s.
+	virtual bool sample_emission(Vec3Dd& direction, double& pdf, sampler& s) const
+	{
+		return false;
+	}
+
+	// The pdf sample_emission picks the unit vector direction with
+	virtual double emission_pdf(const Vec3Dd& direction) const
+	{
+		return 0;
+	}
 };
 
 struct debug_normal_material : material
@@ -18,7 +86,7 @@ struct debug_normal_material : material
 	{
 	}
 
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const
+	virtual fRGBA emitted(const ray& r, const ray_intersection& ri) const
 	{
 		return fRGBA((float)(ri.normal[0] * 0.5 + 0.5), (float)(ri.normal[1] * 0.5 + 0.5), (float)(ri.normal[2] * 0.5 + 0.5));
 	}
@@ -33,7 +101,13 @@ struct basic_colour_material : material
 	{
 	}
 
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const;
+	virtual bool has_diffuse_lobe() const
+	{
+		return true;
+	}
+
+	virtual std::optional<scatter_record> scatter(const ray& r, const ray_intersection& ri, sampler& s) const;
+	virtual fRGBA evaluate(const ray& r, const ray_intersection& ri, const Vec3Dd& direction, double& pdf) const;
 };
 
 struct basic_metal_material : material
@@ -45,7 +119,7 @@ struct basic_metal_material : material
 	{
 	}
 
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const;
+	virtual std::optional<scatter_record> scatter(const ray& r, const ray_intersection& ri, sampler& s) const;
 };
 
 struct basic_dialectric_material : material
@@ -57,7 +131,7 @@ struct basic_dialectric_material : material
 	{
 	}
 
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const;
+	virtual std::optional<scatter_record> scatter(const ray& r, const ray_intersection& ri, sampler& s) const;
 };
 
 struct basic_texture_material : material
@@ -69,22 +143,49 @@ struct basic_texture_material : material
 	{
 	}
 
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const;
+	virtual bool has_diffuse_lobe() const
+	{
+		return true;
+	}
+
+	virtual std::optional<scatter_record> scatter(const ray& r, const ray_intersection& ri, sampler& s) const;
+	virtual fRGBA evaluate(const ray& r, const ray_intersection& ri, const Vec3Dd& direction, double& pdf) const;
 };
 
+// Sky from a lat-long texture, with the top half of the texture covering the upper hemisphere and
+// mirrored below the horizon. The sky can be sampled for next-event estimation: the texture is split
+// into cells of one texel between texel centres, each picked in proportion to its light, the average of
+// its corners, times its solid angle, and a direction then picked uniformly over the cell's solid angle.
+// A row is picked first and then a cell in it, so the few rows most samples land in stay in cache.
+// Unless told not to, the sky is also baked into an octahedral map at load, which emitted() looks up
+// without any trig, at about the resolution of the top half of the texture.
 struct basic_sky_texture_material : material
 {
 	std::shared_ptr<texture> tex;
 
-	basic_sky_texture_material(std::shared_ptr<texture> tex)
-		: tex(std::move(tex))
-	{
-	}
+	basic_sky_texture_material(std::shared_ptr<texture> tex, bool bake_octahedral = true);
 
-	virtual fRGBA sample(const scene& sc, const ray_intersection& ri) const;
-};
+	virtual fRGBA emitted(const ray& r, const ray_intersection& ri) const;
+	virtual void sky_emitted(std::span<const Vec3Dd> directions, std::span<fRGBA> colours) const;
+	virtual bool sample_emission(Vec3Dd& direction, double& pdf, sampler& s) const;
+	virtual double emission_pdf(const Vec3Dd& direction) const;
+
+private:
+	// Texture coordinates of direction
+	static Vec2d direction_texcoord(const Vec3Dd& direction);
 
-#include "scene.h"
+	// emitted() straight from the texture
+	fRGBA texture_emitted(const Vec3Dd& direction) const;
+
+	octahedral_map baked;
+
+	int cells_x = 0;
+	int cells_y = 0; // Covering the top half of the texture
+	std::vector<double> row_heights; // Height above the horizon of the top of each row and the bottom of the last
+	alias_table rows;
+	std::vector<alias_table> row_cells;
+	std::vector<float> cell_pdfs; // Solid angle pdf of the directions in each cell, row by row
+};
 
 inline Vec3Dd reflect(const Vec3Dd& v, const Vec3Dd& n)
 {
@@ -100,22 +201,45 @@ inline Vec3Dd refract(const Vec3Dd& v, const Vec3Dd& n, double ref_idx)
 	return r_out_perp + r_out_parallel;
 }
 
-fRGBA basic_colour_material::sample(const scene& sc, const ray_intersection& ri) const
+// Pdf of the cosine-weighted directions the diffuse materials scatter along, normal + a point on the unit sphere
+inline double lambertian_pdf(const Vec3Dd& normal, const Vec3Dd& direction)
+{
+	return std::max(dot_product(normal, normalize_vector(direction)), 0.0) * std::numbers::inv_pi;
+}
+
+// The cone a ray scattered with solid angle pdf carries on with. Path differentials give a sampled direction
+// about 1 / pdf of solid angle to itself, which a cone spreading by s per unit of distance covers at
+// pi s^2 / 4. That's far wider than a pixel, so diffuse bounces look textures up from coarse mip levels.
+// Rays without a cone keep sampling finest detail.
+inline void widen_cone(ray& scattered, double pdf)
+{
+	if (pdf > 0 && scattered.cone_spread > 0)
+		scattered.cone_spread = std::max(scattered.cone_spread, (float)(2 / std::sqrt(std::numbers::pi * pdf)));
+}
+
+std::optional<scatter_record> basic_colour_material::scatter(const ray& r, const ray_intersection& ri, sampler& s) const
 {
 	//Vec3Dd R = random_on_hemisphere(ri.normal);
-	Vec3Dd R = ri.normal + random_unit_vector();
+	Vec3Dd R = ri.normal + sphere_point(s.get_2d());
 	if (horizontal_and(is_zero_or_subnormal(R.to_vector())))
 		R = ri.normal;
 
-	ray r2 = ray::make_scatter_ray(ri, R);
-	return diffuse_colour * sc.ray_colour(r2);
+	scatter_record scattered = { diffuse_colour, r.scatter(ri, R), lambertian_pdf(ri.normal, R) };
+	widen_cone(scattered.scattered, scattered.pdf);
+	return scattered;
+}
+
+fRGBA basic_colour_material::evaluate(const ray& r, const ray_intersection& ri, const Vec3Dd& direction, double& pdf) const
+{
+	// Lambertian, diffuse_colour / pi times the cosine, which is the pdf times diffuse_colour
+	pdf = lambertian_pdf(ri.normal, direction);
+	return diffuse_colour * (float)pdf;
 }
 
-fRGBA basic_metal_material::sample(const scene& sc, const ray_intersection& ri) const
+std::optional<scatter_record> basic_metal_material::scatter(const ray& r, const ray_intersection& ri, sampler& s) const
 {
-	Vec3Dd R = reflect(ri.r.direction, ri.normal);
-	ray r2 = ray::make_scatter_ray(ri, R);
-	return diffuse_colour * sc.ray_colour(r2);
+	Vec3Dd R = reflect(r.direction, ri.normal);
+	return scatter_record{ diffuse_colour, r.scatter(ri, R) };
 }
 
 inline double schlick_reflectance(double cosine, double ref_idx_1, double ref_idx_2)
@@ -126,58 +250,191 @@ inline double schlick_reflectance(double cosine, double ref_idx_1, double ref_id
 	return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
 
-fRGBA basic_dialectric_material::sample(const scene& sc, const ray_intersection& ri) const
+std::optional<scatter_record> basic_dialectric_material::scatter(const ray& r, const ray_intersection& ri, sampler& s) const
 {
 	const fRGBA diffuse_colour = { 1.0, 1.0, 1.0 };
-	bool is_front_face = dot_product(ri.r.direction, ri.normal) < 0;
-	double new_ref_idx = is_front_face ? ir : 1.0; // todo: ir stack?
-	double refraction_ratio = ri.r.current_refractive_index / new_ref_idx;
-	auto normal = is_front_face ? ri.normal : -ri.normal;
+	double new_ref_idx = ri.front_face ? ir : 1.0; // todo: ir stack?
+	double refraction_ratio = r.current_refractive_index / new_ref_idx;
+	const Vec3Dd& normal = ri.normal;
 
-	Vec3Dd unit_direction = normalize_vector(ri.r.direction);
+	Vec3Dd unit_direction = normalize_vector(r.direction);
 	double cos_theta = fmin(dot_product(-unit_direction, normal), 1.0);
 	double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
 	bool cannot_refract = refraction_ratio * sin_theta > 1.0;
 	Vec3Dd R;
 
-	if (cannot_refract || schlick_reflectance(cos_theta, ri.r.current_refractive_index, new_ref_idx) > random_double())
+	if (cannot_refract || schlick_reflectance(cos_theta, r.current_refractive_index, new_ref_idx) > s.get_1d())
 	{
-		R = reflect(ri.r.direction, normal);
-		new_ref_idx = ri.r.current_refractive_index;
+		R = reflect(r.direction, normal);
+		new_ref_idx = r.current_refractive_index;
 	}
 	else
 	{
-		R = refract(ri.r.direction, normal, refraction_ratio);
+		R = refract(r.direction, normal, refraction_ratio);
 	}
 
-	ray r2 = ray::make_scatter_ray(ri, R);
+	ray r2 = r.scatter(ri, R);
 	r2.current_refractive_index = new_ref_idx;
-	return diffuse_colour * sc.ray_colour(r2);
+	return scatter_record{ diffuse_colour, r2 };
 }
 
-fRGBA basic_texture_material::sample(const scene& sc, const ray_intersection& ri) const
+std::optional<scatter_record> basic_texture_material::scatter(const ray& r, const ray_intersection& ri, sampler& s) const
 {
-	auto C = tex->sample(ri.texcoord);
-	Vec3Dd R = ri.normal + random_unit_vector();
+	auto C = tex->sample(ri.texcoord, ri.texcoord_footprint);
+	Vec3Dd R = ri.normal + sphere_point(s.get_2d());
 	if (horizontal_and(is_zero_or_subnormal(R.to_vector())))
 		R = ri.normal;
 
-	ray r2 = ray::make_scatter_ray(ri, R);
-	return C * sc.ray_colour(r2);
+	scatter_record scattered = { C, r.scatter(ri, R), lambertian_pdf(ri.normal, R) };
+	widen_cone(scattered.scattered, scattered.pdf);
+	return scattered;
 }
 
-fRGBA basic_sky_texture_material::sample(const scene& sc, const ray_intersection& ri) const
+fRGBA basic_texture_material::evaluate(const ray& r, const ray_intersection& ri, const Vec3Dd& direction, double& pdf) const
 {
-	Vec3Dd unit_direction = normalize_vector(ri.r.direction);
+	pdf = lambertian_pdf(ri.normal, direction);
+	return tex->sample(ri.texcoord, ri.texcoord_footprint) * (float)pdf;
+}
+
+basic_sky_texture_material::basic_sky_texture_material(std::shared_ptr<texture> tex, bool bake_octahedral)
+	: tex(std::move(tex))
+{
+	if (bake_octahedral && this->tex->width() > 0 && this->tex->height() > 0)
+	{
+		const int baked_size = (int)sqrt((double)this->tex->width() * this->tex->height());
+		baked = octahedral_map(baked_size, [this](const Vec3Dd& direction) { return texture_emitted(direction); });
+	}
+
+	cells_x = this->tex->width();
+	cells_y = this->tex->height() / 2;
+	if (cells_x <= 0 || cells_y <= 0)
+		return;
+
+	// Corners fall on texel centres, where the bilinear filter gives the texel itself, so each cell's
+	// average corner is the average of the filtered sky over the cell
+	std::vector<double> corners((size_t)(cells_x + 1) * (cells_y + 1));
+	for (int y = 0; y <= cells_y; ++y)
+	{
+		for (int x = 0; x <= cells_x; ++x)
+		{
+			const fRGBA C = this->tex->sample(Vec2d((double)x / cells_x, 0.5 * y / cells_y));
+			corners[(size_t)y * (cells_x + 1) + x] = 0.2126 * C.R + 0.7152 * C.G + 0.0722 * C.B;
+		}
+	}
+
+	// A row covers the heights from cos(v0 * pi) down to cos(v1 * pi) above the horizon, and as much below it
+	row_heights.resize(cells_y + 1);
+	for (int y = 0; y <= cells_y; ++y)
+	{
+		row_heights[y] = cos(0.5 * y / cells_y * std::numbers::pi);
+	}
+
+	std::vector<double> weights((size_t)cells_x * cells_y);
+	std::vector<double> solid_angles(cells_y);
+	for (int y = 0; y < cells_y; ++y)
+	{
+		solid_angles[y] = 2 * (2 * std::numbers::pi / cells_x) * (row_heights[y] - row_heights[y + 1]);
+		for (int x = 0; x < cells_x; ++x)
+		{
+			const double* top = &corners[(size_t)y * (cells_x + 1) + x];
+			const double* bottom = top + cells_x + 1;
+			weights[(size_t)y * cells_x + x] = (top[0] + top[1] + bottom[0] + bottom[1]) * 0.25 * solid_angles[y];
+		}
+	}
+
+	std::vector<double> row_weights(cells_y);
+	row_cells.resize(cells_y);
+	for (int y = 0; y < cells_y; ++y)
+	{
+		const std::span<const double> row(&weights[(size_t)y * cells_x], cells_x);
+		row_weights[y] = std::accumulate(row.begin(), row.end(), 0.0);
+		row_cells[y] = alias_table(row);
+	}
+	rows = alias_table(row_weights);
+	if (rows.empty())
+		return;
+
+	cell_pdfs.resize(weights.size());
+	for (int y = 0; y < cells_y; ++y)
+	{
+		for (int x = 0; x < cells_x; ++x)
+		{
+			cell_pdfs[(size_t)y * cells_x + x] = row_cells[y].empty() ? 0.0f : (float)(rows.probability(y) * row_cells[y].probability(x) / solid_angles[y]);
+		}
+	}
+}
+
+Vec2d basic_sky_texture_material::direction_texcoord(const Vec3Dd& direction)
+{
+	double yaw = atan2(direction.get_x(), direction.get_z()) * (std::numbers::inv_pi / 2) + 0.5;
+	double pitch = asin(direction.get_y()) * std::numbers::inv_pi * 2;
+	return { yaw, fmin(0.5 + pitch * 0.5, 0.5 - pitch * 0.5) };
+}
+
+fRGBA basic_sky_texture_material::emitted(const ray& r, const ray_intersection& ri) const
+{
+	return baked.empty() ? texture_emitted(r.direction) : baked.lookup(r.direction);
+}
+
+void basic_sky_texture_material::sky_emitted(std::span<const Vec3Dd> directions, std::span<fRGBA> colours) const
+{
+	if (baked.empty())
+		material::sky_emitted(directions, colours);
+	else
+		baked.lookup(directions, colours);
+}
+
+fRGBA basic_sky_texture_material::texture_emitted(const Vec3Dd& direction) const
+{
+	Vec3Dd unit_direction = normalize_vector(direction);
 
 	//float y = 0.5f * ((float)unit_direction.get_y() + 1.0f);
 	//return Lerp(fRGBA(1.0f, 1.0f, 1.0f), fRGBA(0.5f, 0.7f, 1.0f), y);
 
-	double yaw = atan2(unit_direction.get_x(), unit_direction.get_z()) * (std::numbers::inv_pi / 2) + 0.5;
-	double pitch = asin(unit_direction.get_y()) * std::numbers::inv_pi * 2;
-	Vec2d texcoord = { yaw, fmin(0.5 + pitch * 0.5, 0.5 - pitch * 0.5) };
-
-	auto C = tex->sample(texcoord);
+	auto C = tex->sample(direction_texcoord(unit_direction));
 	return C;
 }
+
+bool basic_sky_texture_material::sample_emission(Vec3Dd& direction, double& pdf, sampler& s) const
+{
+	if (rows.empty())
+		return false;
+
+	// One 2D sample picks the cell and where in it. Stratified samples pick in order so they cover the sky
+	// stratified, independent ones take the alias tables' constant time picks.
+	const Vec2d u = s.get_2d();
+	double height_fraction, yaw_fraction;
+	int y, x;
+	if (s.stratified())
+	{
+		y = rows.sample_ordered(u[0], height_fraction);
+		x = row_cells[y].sample_ordered(u[1], yaw_fraction);
+	}
+	else
+	{
+		y = rows.sample(u[0], height_fraction);
+		x = row_cells[y].sample(u[1], yaw_fraction);
+	}
+
+	// Uniform in yaw and in height, which is uniform in solid angle, then above or below the horizon by
+	// which half of its range the height's fraction fell in
+	const bool below = height_fraction >= 0.5;
+	const double yaw = ((x + yaw_fraction) / cells_x - 0.5) * 2 * std::numbers::pi;
+	const double height = row_heights[y + 1] + (row_heights[y] - row_heights[y + 1]) * (height_fraction * 2 - below);
+	const double horizontal = sqrt(std::max(1 - height * height, 0.0));
+	direction = Vec3Dd(horizontal * sin(yaw), below ? -height : height, horizontal * cos(yaw));
+	pdf = cell_pdfs[(size_t)y * cells_x + x];
+	return true;
+}
+
+double basic_sky_texture_material::emission_pdf(const Vec3Dd& direction) const
+{
+	if (rows.empty())
+		return 0;
+
+	const Vec2d texcoord = direction_texcoord(direction);
+	const int x = std::clamp((int)(texcoord[0] * cells_x), 0, cells_x - 1);
+	const int y = std::clamp((int)(texcoord[1] * 2 * cells_y), 0, cells_y - 1);
+	return cell_pdfs[(size_t)y * cells_x + x];
+}
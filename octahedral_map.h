@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <span>
+#include <vector>
+
+#include "common/vectorclass/vector3d.h"
+#include "common/math/colour.h"
+
+// Colour for every direction stored in an octahedral layout: a direction is projected onto the octahedron
+// |x| + |y| + |z| = 1, the upper half (y >= 0) is flattened onto the square seen from above and the lower
+// half folded out over its corners. Finding a direction's texel takes a division and a few multiplies,
+// against the atan2 and asin of a lat-long map, and directions don't need to be normalised.
+class octahedral_map
+{
+public:
+	octahedral_map() = default;
+
+	// Bakes a size x size map from colour_fn(direction), called once per texel with a unit direction
+	template<typename colour_fn>
+	octahedral_map(int size, colour_fn&& colour)
+		: size(size)
+		, texels((size_t)size * size)
+	{
+		for (int y = 0; y < size; ++y)
+		{
+			for (int x = 0; x < size; ++x)
+			{
+				texels[(size_t)y * size + x] = colour(direction((x + 0.5) / size, (y + 0.5) / size));
+			}
+		}
+	}
+
+	bool empty() const
+	{
+		return texels.empty();
+	}
+
+	// Bilinear filtered colour along direction, which must not be zero
+	fRGBA lookup(const Vec3Dd& d) const
+	{
+		const double x = d.get_x(), y = d.get_y(), z = d.get_z();
+		const double inv_l1 = 1.0 / (fabs(x) + fabs(y) + fabs(z));
+		double u = x * inv_l1;
+		double v = z * inv_l1;
+		if (y < 0)
+		{
+			const double folded_u = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+			v = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+			u = folded_u;
+		}
+
+		// Texel coordinates, with texel centres on whole numbers. Clamped at the edges, where the octahedron
+		// really continues on the far side of the fold, which only blurs the last half texel.
+		const double scaled_x = std::clamp(u * (0.5 * size) + (0.5 * size - 0.5), 0.0, size - 1.0);
+		const double scaled_y = std::clamp(v * (0.5 * size) + (0.5 * size - 0.5), 0.0, size - 1.0);
+		const int texel_x = (int)scaled_x;
+		const int texel_y = (int)scaled_y;
+		return blend(texel_x, texel_y, (float)(scaled_x - texel_x), (float)(scaled_y - texel_y));
+	}
+
+	// lookup() for every direction at once, four at a time in SIMD. colours must be as long as directions.
+	void lookup(std::span<const Vec3Dd> directions, std::span<fRGBA> colours) const
+	{
+		size_t i = 0;
+		for (; i + 4 <= directions.size(); i += 4)
+		{
+			const Vec4d x(directions[i].get_x(), directions[i + 1].get_x(), directions[i + 2].get_x(), directions[i + 3].get_x());
+			const Vec4d y(directions[i].get_y(), directions[i + 1].get_y(), directions[i + 2].get_y(), directions[i + 3].get_y());
+			const Vec4d z(directions[i].get_z(), directions[i + 1].get_z(), directions[i + 2].get_z(), directions[i + 3].get_z());
+			const Vec4d inv_l1 = 1.0 / (abs(x) + abs(y) + abs(z));
+			const Vec4d u = x * inv_l1;
+			const Vec4d v = z * inv_l1;
+			const Vec4db fold = y < 0;
+			const Vec4d folded_u = select(fold, sign_combine(1 - abs(v), u), u);
+			const Vec4d folded_v = select(fold, sign_combine(1 - abs(u), v), v);
+
+			const Vec4d scaled_x = min(max(folded_u * (0.5 * size) + (0.5 * size - 0.5), 0.0), size - 1.0);
+			const Vec4d scaled_y = min(max(folded_v * (0.5 * size) + (0.5 * size - 0.5), 0.0), size - 1.0);
+			const Vec4d floor_x = floor(scaled_x);
+			const Vec4d floor_y = floor(scaled_y);
+			const Vec4i texel_x = truncate_to_int32(floor_x);
+			const Vec4i texel_y = truncate_to_int32(floor_y);
+			const Vec4d fraction_x = scaled_x - floor_x;
+			const Vec4d fraction_y = scaled_y - floor_y;
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				colours[i + lane] = blend(texel_x[lane], texel_y[lane], (float)fraction_x[lane], (float)fraction_y[lane]);
+			}
+		}
+		for (; i < directions.size(); ++i)
+		{
+			colours[i] = lookup(directions[i]);
+		}
+	}
+
+private:
+	// Unit direction at octahedral coordinates u and v in [0, 1]
+	static Vec3Dd direction(double u, double v)
+	{
+		double x = u * 2 - 1;
+		double z = v * 2 - 1;
+		const double y = 1 - fabs(x) - fabs(z);
+		if (y < 0)
+		{
+			const double unfolded_x = (1 - fabs(z)) * (x >= 0 ? 1 : -1);
+			z = (1 - fabs(x)) * (z >= 0 ? 1 : -1);
+			x = unfolded_x;
+		}
+		return normalize_vector(Vec3Dd(x, y, z));
+	}
+
+	fRGBA blend(int texel_x, int texel_y, float fraction_x, float fraction_y) const
+	{
+		const int next_x = std::min(texel_x + 1, size - 1);
+		const int next_y = std::min(texel_y + 1, size - 1);
+		const fRGBA* row = &texels[(size_t)texel_y * size];
+		const fRGBA* next_row = &texels[(size_t)next_y * size];
+		return Lerp(
+			Lerp(row[texel_x], row[next_x], fraction_x),
+			Lerp(next_row[texel_x], next_row[next_x], fraction_x),
+			fraction_y);
+	}
+
+	int size = 0;
+	std::vector<fRGBA> texels; // Row by row, v down the rows
+};
@@ -1,42 +1,213 @@
 #pragma once
 
+#include <array>
+#include <cmath>
 #include <memory>
+#include <span>
+#include <type_traits>
 
 #include "common/vectorclass/vector3d.h"
 
-struct material;
-struct ray_intersection;
+// Vector types for tracing in single or double precision: vec3 for one ray's points and directions,
+// vec4 for the vector it is stored in, and packet for one value per ray of a ray packet
+template <typename T>
+struct vector_types;
 
-struct ray
+template <>
+struct vector_types<double>
 {
-    Vec3Dd at(double t) const
+    using vec3 = Vec3Dd;
+    using vec4 = Vec4d;
+    using packet = Vec4d;
+    using packet_mask = Vec4db;
+};
+
+template <>
+struct vector_types<float>
+{
+    using vec3 = Vec3Df;
+    using vec4 = Vec4f;
+    using packet = Vec8f;
+    using packet_mask = Vec8fb;
+};
+
+template <typename T>
+using vec3_t = typename vector_types<T>::vec3;
+
+// v in the precision of T
+template <typename T>
+vec3_t<T> convert_vector(const Vec3Dd& v)
+{
+    if constexpr (std::is_same_v<T, double>)
+        return v;
+    else
+        return to_float(v);
+}
+
+template <typename T>
+vec3_t<T> convert_vector(const Vec3Df& v)
+{
+    if constexpr (std::is_same_v<T, float>)
+        return v;
+    else
+        return to_double(v);
+}
+
+template <typename T>
+struct basic_ray_intersection;
+
+template <typename T>
+struct basic_ray
+{
+    vec3_t<T> at(T t) const
     {
         return origin + t * direction;
     }
 
-    Vec3Dd origin;
-    Vec3Dd direction;
+    vec3_t<T> origin;
+    vec3_t<T> direction;
     int remaining_depth;
     double current_refractive_index = 1.0;
 
-    static ray make_scatter_ray(const ray_intersection& ri, Vec3Dd direction);
+    // Ray cone, for how much of a texture a hit covers: the cone is cone_width across at the origin
+    // and widens by cone_spread per unit of distance. Zero for a ray that should sample finest detail.
+    float cone_width = 0;
+    float cone_spread = 0;
+
+    // Width of the cone at t along the ray
+    float cone_width_at(T t) const
+    {
+        return cone_width + cone_spread * (float)(t * std::sqrt(dot_product(direction, direction)));
+    }
+
+    // The ray leaving ri, where this ray hit
+    basic_ray scatter(const basic_ray_intersection<T>& ri, vec3_t<T> direction) const;
 };
 
-struct ray_intersection
+// What shading needs to know about a hit, written in place by the traceable that was hit
+template <typename T>
+struct basic_ray_intersection
 {
-    Vec3Dd location;
-    Vec3Dd normal;
+    vec3_t<T> location;
+    vec3_t<T> normal; // Shading normal, turned to face back along the ray
     Vec2d texcoord;
-    std::shared_ptr<material> mat;
-    ray r;
-    double t;
+    float texcoord_footprint; // Width of the ray's cone at the hit in texture coordinates, 0 for finest detail
+    int material; // Index into the scene's materials
+    T t;
+    bool front_face; // Whether the ray hit the outside of the surface, by its geometric normal
+
+    // Sets front_face from the outward geometric normal and normal from the outward shading normal,
+    // which can point either way from the ray when it's interpolated or the ray hit the back
+    void set_normal(const basic_ray<T>& r, const vec3_t<T>& geometric_normal, const vec3_t<T>& shading_normal)
+    {
+        front_face = dot_product(r.direction, geometric_normal) < 0;
+        normal = dot_product(r.direction, shading_normal) < 0 ? shading_normal : -shading_normal;
+    }
 };
 
-ray ray::make_scatter_ray(const ray_intersection& ri, Vec3Dd direction)
+using ray = basic_ray<double>;
+using ray_intersection = basic_ray_intersection<double>;
+
+// r in the precision of T
+template <typename T, typename U>
+basic_ray<T> convert_ray(const basic_ray<U>& r)
+{
+    return basic_ray<T>{ convert_vector<T>(r.origin), convert_vector<T>(r.direction), r.remaining_depth, r.current_refractive_index, r.cone_width, r.cone_spread };
+}
+
+// The materials shade in double precision, single precision rays and hits are converted for them
+template <typename T>
+decltype(auto) double_ray(const basic_ray<T>& r)
+{
+    if constexpr (std::is_same_v<T, double>)
+        return (r);
+    else
+        return convert_ray<double>(r);
+}
+
+template <typename T>
+decltype(auto) double_intersection(const basic_ray_intersection<T>& ri)
+{
+    if constexpr (std::is_same_v<T, double>)
+        return (ri);
+    else
+        return ray_intersection{ convert_vector<double>(ri.location), convert_vector<double>(ri.normal), ri.texcoord, ri.texcoord_footprint, ri.material, ri.t, ri.front_face };
+}
+
+// Rays traced together, with their origins and directions also held as x, y and z vectors
+// so they can be tested against a primitive or a bounding box at once.
+// There are as many rays as lanes in a packet vector: 4 in double precision, 8 in single.
+template <typename T>
+struct basic_ray_packet
+{
+    using packet = typename vector_types<T>::packet;
+    static constexpr int size = packet::size();
+
+    // Takes 1 to size rays, the remaining lanes repeat the first ray so they can be traced harmlessly
+    explicit basic_ray_packet(std::span<const basic_ray<T>> packet_rays)
+        : count((int)packet_rays.size())
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            rays[i] = packet_rays[i < count ? i : 0];
+        }
+        if constexpr (size == 4)
+        {
+            transpose(rays[0].origin, rays[1].origin, rays[2].origin, rays[3].origin, origin);
+            transpose(rays[0].direction, rays[1].direction, rays[2].direction, rays[3].direction, direction);
+        }
+        else
+        {
+            // Two halves of four rays each
+            typename vector_types<T>::vec4 low[3], high[3];
+            transpose(rays[0].origin, rays[1].origin, rays[2].origin, rays[3].origin, low);
+            transpose(rays[4].origin, rays[5].origin, rays[6].origin, rays[7].origin, high);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                origin[axis] = packet(low[axis], high[axis]);
+            }
+            transpose(rays[0].direction, rays[1].direction, rays[2].direction, rays[3].direction, low);
+            transpose(rays[4].direction, rays[5].direction, rays[6].direction, rays[7].direction, high);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                direction[axis] = packet(low[axis], high[axis]);
+            }
+        }
+    }
+
+    basic_ray<T> rays[size];
+    int count; // Lanes holding real rays
+    packet origin[3];
+    packet direction[3];
+
+private:
+    using vec3 = vec3_t<T>;
+    using vec4 = typename vector_types<T>::vec4;
+
+    // Four x, y, z vectors to one vector each of x, y and z
+    static void transpose(const vec3& a, const vec3& b, const vec3& c, const vec3& d, vec4 (&result)[3])
+    {
+        const vec4 ab_xy = blend4<0, 4, 1, 5>(a.to_vector(), b.to_vector());
+        const vec4 ab_z = blend4<2, 6, 2, 6>(a.to_vector(), b.to_vector());
+        const vec4 cd_xy = blend4<0, 4, 1, 5>(c.to_vector(), d.to_vector());
+        const vec4 cd_z = blend4<2, 6, 2, 6>(c.to_vector(), d.to_vector());
+        result[0] = blend4<0, 1, 4, 5>(ab_xy, cd_xy);
+        result[1] = blend4<2, 3, 6, 7>(ab_xy, cd_xy);
+        result[2] = blend4<0, 1, 4, 5>(ab_z, cd_z);
+    }
+};
+
+using ray_packet = basic_ray_packet<double>;
+
+template <typename T>
+basic_ray<T> basic_ray<T>::scatter(const basic_ray_intersection<T>& ri, vec3_t<T> direction) const
 {
-    ray result = ri.r;
-    result.origin = ri.location + 0.0001 * direction,
+    basic_ray result = *this;
+    result.origin = ri.location + T(0.0001) * direction,
     result.direction = direction;
     result.remaining_depth--;
+    // The cone carries on from the hit as wide as it got there, spreading as before. Materials that
+    // scatter diffusely widen the spread themselves, curved mirrors and glass are left out.
+    result.cone_width = cone_width_at(ri.t);
     return result;
 }
@@ -10,60 +10,470 @@
 
 #include "camera.h"
 #include "scene.h"
+#include "task_scheduler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 struct renderer
 {
 public:
 	int image_width = 100;  // Rendered image width in pixel count
 	int image_height = 100; // Rendered image height
-	int num_samples = 1;
+	int num_samples = 1;    // Samples per pixel, the upper limit when adaptive_sampling is on
 	int recursion_depth = 10;
+	int num_threads = 0;    // Worker thread count, 0 uses every hardware thread
+	int tile_size = 32;     // Width and height of the tiles the image is initially split into, busy tiles are split further on demand
+	std::string output_file = "output.png"; // PNG written by render(), empty to skip writing
+	bool packet_tracing = true; // Trace each pixel's camera rays together in packets, later bounces are traced one ray at a time
+	// Camera rays carry a cone spreading one pixel wide per pixel of distance, which mip mapped textures are
+	// filtered over instead of aliasing where their detail is smaller than a pixel. Diffuse bounces widen it.
+	bool ray_cones = true;
+	// Where each sample's numbers come from. Sobol samples are stratified over the pixel, so the error falls
+	// nearly as 1 / samples on smooth parts of the image rather than 1 / sqrt(samples). Adaptive sampling
+	// still estimates the error as if the samples were independent, which overestimates it for Sobol.
+	sampler_type sampling = sampler_type::sobol;
+	integrator_settings integrator;
 
-	void render(const camera& cam, const scene& sc)
+	// Adaptive sampling stops sampling a pixel once the standard error of its mean luminance,
+	// relative to that mean, drops below target_relative_error.
+	bool adaptive_sampling = false;
+	int min_samples = 32;      // Samples every pixel takes before its error estimate is trusted
+	int samples_per_pass = 32; // Samples added to each unconverged pixel per pass
+	double target_relative_error = 0.01;
+
+	// Progressive rendering adds samples_per_pass to every pixel each pass until num_samples is reached
+	// or time_budget runs out, whichever comes first. The time budget applies to adaptive sampling too.
+	bool progressive = false;
+	double time_budget = 0; // Seconds of rendering allowed, 0 for no limit. The first pass always completes.
+
+	// Each pixel's samples are seeded from this, its position and its sample count, so a render gives
+	// the same image whichever threads run it and a resumed render continues the same sequences.
+	uint64_t seed = 0;
+
+	// With a checkpoint_file set the accumulation buffer is saved to it every checkpoint_interval seconds,
+	// between passes of at most samples_per_pass samples, and render() resumes from the file if it exists.
+	// A checkpoint is only resumed with the same image size, seed, sampling and integrator settings it was written with.
+	std::string checkpoint_file;
+	double checkpoint_interval = 300;
+
+	struct render_stats
 	{
-		const double aspect_ratio = static_cast<double>(image_width) / image_height;
+		double average_samples_per_pixel = 0;
+		int min_samples_per_pixel = 0;
+		int passes = 0;
+		double rays_per_pixel = 0; // Rays traced by this run, including every bounce, per pixel
+		double seconds = 0;
+	};
+
+	using image_buffer = std::experimental::mdarray<fRGBA, std::experimental::dextents<int, 2>>;
+
+	// Traces in the precision the scene is in
+	template <typename T>
+	render_stats render(const camera& cam, const basic_scene<T>& sc)
+	{
+		render_stats stats;
+		const image_buffer linear_image = render_image(cam, sc, stats);
+
+		if (!output_file.empty())
+		{
+			std::experimental::mdarray<RGBA, std::experimental::dextents<int, 2>> image(image_height, image_width);
+			linear_to_sRGB(std::span(linear_image.data(), linear_image.size()), std::span(image.data(), image.size()));
+			stbi_write_png(output_file.c_str(), image_width, image_height, 4, image.data(), image.stride(0) * 4);
+		}
+
+		return stats;
+	}
+
+	// Renders the scene to linear colour, without writing it out
+	template <typename T>
+	image_buffer render_image(const camera& cam, const basic_scene<T>& sc, render_stats& stats)
+	{
+		sc.prepare();
+
+		// No pixels means no tiles for the workers to share out
+		if (image_width <= 0 || image_height <= 0)
+		{
+			stats = {};
+			return image_buffer(std::max(image_height, 0), std::max(image_width, 0));
+		}
 
-		// Determine viewport dimensions.
-		constexpr auto viewport_height = 2.0;
-		const auto viewport_width = viewport_height * aspect_ratio;
+		const auto start_time = std::chrono::steady_clock::now();
+		const auto deadline = start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_budget));
+		auto out_of_time = [&]()
+		{
+			return time_budget > 0 && std::chrono::steady_clock::now() >= deadline;
+		};
 
-		// Calculate the vectors across the horizontal and down the vertical viewport edges.
-		const auto viewport_u = Vec3Dd(viewport_width, 0, 0);
-		const auto viewport_v = Vec3Dd(0, -viewport_height, 0);
+		const basic_camera_viewport<T> viewport(cam, image_width, image_height);
 
-		// Calculate the horizontal and vertical delta vectors from pixel to pixel.
-		const auto pixel_delta_u = viewport_u / image_width;
-		const auto pixel_delta_v = viewport_v / image_height;
+		const double cone_scale = ray_cones ? 1 : 0;
+		auto jittered_ray = [&](int x, int y, sampler& s)
+		{
+			const Vec2d jitter = s.get_2d();
+			return viewport.primary_ray(x + jitter[0], y + jitter[1], recursion_depth, cone_scale);
+		};
 
-		// Calculate the location of the upper left pixel.
-		const auto viewport_upper_left =
-			cam.origin + Vec3Dd(0, 0, cam.focal_length) - viewport_u / 2 - viewport_v / 2;
+		// Adds count jittered samples of the pixel, traced in packets when packet_tracing is on
+		auto sample_pixel = [&](int x, int y, int count, pixel_accumulator& pixel, long long& ray_count)
+		{
+			const uint64_t pixel_seed = mix_seed(seed, (uint64_t)y * image_width + x);
+			if (!packet_tracing)
+			{
+				for (int i = 0; i < count; ++i)
+				{
+					sampler s(sampling, pixel_seed, (uint32_t)pixel.samples);
+					pixel.add_sample(sc.ray_colour(jittered_ray(x, y, s), integrator, s, ray_count));
+				}
+				return;
+			}
 
-		std::experimental::mdarray<RGBA, std::experimental::dextents<int, 2>> image(image_height, image_width);
+			for (int i = 0; i < count; i += basic_ray_packet<T>::size)
+			{
+				basic_ray<T> rays[basic_ray_packet<T>::size];
+				sampler samplers[basic_ray_packet<T>::size];
+				const int packet_size = std::min(basic_ray_packet<T>::size, count - i);
+				for (int j = 0; j < packet_size; ++j)
+				{
+					samplers[j] = sampler(sampling, pixel_seed, (uint32_t)(pixel.samples + j));
+					rays[j] = jittered_ray(x, y, samplers[j]);
+				}
+
+				const auto colours = sc.ray_colour(basic_ray_packet<T>(std::span(rays, packet_size)), integrator, std::span(samplers, packet_size), ray_count);
+				for (int j = 0; j < packet_size; ++j)
+				{
+					pixel.add_sample(colours[j]);
+				}
+			}
+		};
+
+		accumulation_buffer accumulation(image_height, image_width);
+
+		// Split the image into tiles, each worker writes only to the pixels of the tiles it takes
+		std::vector<tile> tiles;
+		for (int y = 0; y < image_height; y += tile_size)
+		{
+			for (int x = 0; x < image_width; x += tile_size)
+			{
+				tiles.push_back({ x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height) });
+			}
+		}
+
+		const int thread_count = std::clamp(num_threads > 0 ? num_threads : (int)std::thread::hardware_concurrency(), 1, (int)tiles.size());
+		work_stealing_scheduler<tile> scheduler(thread_count);
+
+		const long long total_pixels = (long long)image_width * image_height;
+		std::mutex progress_mutex;
+		std::atomic<long long> rays_traced = 0;
 
 		// Render
+		// Without adaptive sampling or progressive rendering this is a single pass of num_samples per pixel.
+		// Otherwise each pass adds samples_per_pass to every unconverged pixel, adaptive sampling starting from min_samples.
+
+		const bool multi_pass = adaptive_sampling || progressive || !checkpoint_file.empty();
+		long long active_pixels = total_pixels;
+		int pass = 0;
 
-		for (int y = image_height - 1; y >= 0; --y)
+		if (!checkpoint_file.empty() && load_checkpoint(accumulation, pass))
 		{
-			std::cout << "\rScanlines remaining: " << y << ' ' << std::flush;
-			for (int x = 0; x < image_width; ++x)
+			active_pixels = std::count_if(accumulation.data(), accumulation.data() + accumulation.size(), [](const pixel_accumulator& pixel) { return !pixel.converged; });
+			std::cout << "Resumed from " << checkpoint_file << " after " << pass << " passes, " << active_pixels << " pixels left to sample\n";
+		}
+		auto last_checkpoint_time = std::chrono::steady_clock::now();
+
+		for (; active_pixels > 0 && !(pass > 0 && out_of_time()); ++pass)
+		{
+			const int pass_samples = !multi_pass ? num_samples : (pass == 0 && adaptive_sampling) ? min_samples : std::max(samples_per_pass, 1);
+
+			// Start from an even static split, stealing evens out the tiles that turn out to be expensive
+			for (int i = 0; i < (int)tiles.size(); ++i)
 			{
-				fRGBA pixel_colour(0,0,0,0);
-				for (int i = 0; i < num_samples; ++i)
+				scheduler.push((int)((long long)i * thread_count / tiles.size()), tiles[i]);
+			}
+
+			std::atomic<long long> pixels_remaining = total_pixels;
+			std::atomic<long long> pixels_unconverged = 0;
+
+			scheduler.run([&](tile t, work_stealing_scheduler<tile>::context& ctx)
+			{
+				long long unconverged = 0;
+				long long ray_count = 0;
+				for (int y = t.y0; y < t.y1; ++y)
 				{
-					auto pixel_center = viewport_upper_left + ((x + random_double()) * pixel_delta_u) + ((y + random_double()) * pixel_delta_v);
-					auto ray_direction = pixel_center - cam.origin;
-					ray r(cam.origin, ray_direction, recursion_depth);
-					pixel_colour += sc.ray_colour(r);
+					// Out of time, leave the rest of this pass unsampled
+					if (pass > 0 && out_of_time())
+					{
+						unconverged += (long long)(t.x1 - t.x0) * (t.y1 - y);
+						break;
+					}
+
+					// Hand the bottom half of the rows we have left to any worker that ran out of tiles
+					if (t.y1 - y >= 2 && ctx.has_idle_workers())
+					{
+						const int split_y = y + (t.y1 - y) / 2;
+						ctx.push({ t.x0, split_y, t.x1, t.y1 });
+						t.y1 = split_y;
+					}
+
+					for (int x = t.x0; x < t.x1; ++x)
+					{
+						pixel_accumulator& pixel = accumulation(y, x);
+						if (pixel.converged)
+							continue;
+
+						seed_random(mix_seed(seed, (uint64_t)(y * image_width + x) << 32 | pixel.samples));
+						const int samples = std::min(pass_samples, num_samples - pixel.samples);
+						sample_pixel(x, y, samples, pixel, ray_count);
+
+						pixel.converged = pixel.samples >= num_samples ||
+							(adaptive_sampling && pixel.relative_error() <= target_relative_error);
+						unconverged += !pixel.converged;
+					}
 				}
-				pixel_colour /= (float)num_samples;
+				pixels_unconverged += unconverged;
+				rays_traced += ray_count;
+
+				const long long remaining = pixels_remaining -= (long long)(t.x1 - t.x0) * (t.y1 - t.y0);
+				std::lock_guard lock(progress_mutex);
+				std::cout << "\rPass " << pass + 1 << ": " << 100 - remaining * 100 / total_pixels << "% of " << active_pixels << " pixels " << std::flush;
+			});
+
+			active_pixels = pixels_unconverged;
+
+			if (!checkpoint_file.empty() && std::chrono::steady_clock::now() - last_checkpoint_time >= std::chrono::duration<double>(checkpoint_interval))
+			{
+				save_checkpoint(accumulation, pass + 1);
+				last_checkpoint_time = std::chrono::steady_clock::now();
+			}
+		}
 
-				image(y, x) = RGBA(linear_to_sRGB(pixel_colour));
+		if (!checkpoint_file.empty())
+		{
+			save_checkpoint(accumulation, pass);
+		}
+
+		image_buffer image(image_height, image_width);
+		long long total_samples = 0;
+		int min_pixel_samples = std::numeric_limits<int>::max();
+		for (int y = 0; y < image_height; ++y)
+		{
+			for (int x = 0; x < image_width; ++x)
+			{
+				const pixel_accumulator& pixel = accumulation(y, x);
+				image(y, x) = pixel.sum / (float)pixel.samples;
+				total_samples += pixel.samples;
+				min_pixel_samples = std::min(min_pixel_samples, pixel.samples);
 			}
 		}
 
-		stbi_write_png("output.png", image_width, image_height, 4, image.data(), image.stride(0) * 4);
+		stats = {};
+		stats.average_samples_per_pixel = (double)total_samples / total_pixels;
+		stats.min_samples_per_pixel = min_pixel_samples;
+		stats.passes = pass;
+		stats.rays_per_pixel = (double)rays_traced / total_pixels;
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+		std::cout << "\nSamples per pixel: " << stats.average_samples_per_pixel << " average, " << stats.min_samples_per_pixel << " minimum, "
+			<< stats.passes << " passes in " << stats.seconds << "s\n";
+		std::cout << "Rays per pixel: " << stats.rays_per_pixel << ", " << stats.rays_per_pixel * total_pixels / stats.seconds / 1e6 << " Mrays/s\n";
+		return image;
+	}
+
+private:
+	struct pixel_accumulator
+	{
+		fRGBA sum = fRGBA(0, 0, 0, 0);
+		double luminance_mean = 0; // Running mean and sum of squared deviations of the sample luminance (Welford)
+		double luminance_m2 = 0;
+		int samples = 0;
+		bool converged = false;
+
+		void add_sample(const fRGBA& colour)
+		{
+			sum += colour;
+			++samples;
+
+			const double luminance = 0.2126 * colour.R + 0.7152 * colour.G + 0.0722 * colour.B;
+			const double delta = luminance - luminance_mean;
+			luminance_mean += delta / samples;
+			luminance_m2 += delta * (luminance - luminance_mean);
+		}
+
+		// Standard error of the mean luminance relative to the mean, dark pixels are held to an absolute error instead
+		double relative_error() const
+		{
+			if (samples < 2)
+				return std::numeric_limits<double>::infinity();
+
+			const double variance = luminance_m2 / (samples - 1);
+			return sqrt(variance / samples) / std::max(luminance_mean, 1e-3);
+		}
+	};
+
+	using accumulation_buffer = std::experimental::mdarray<pixel_accumulator, std::experimental::dextents<int, 2>>;
+
+	// Checkpoint file layout: checkpoint_header followed by one checkpoint_pixel per pixel in row order
+	static constexpr char checkpoint_magic[4] = { 'R', 'T', 'C', 'P' };
+	static constexpr uint32_t checkpoint_version = 2;
+
+#pragma pack(push, 1)
+	struct checkpoint_header
+	{
+		char magic[4];
+		uint32_t version;
+		int32_t width;
+		int32_t height;
+		uint64_t seed;
+		int32_t passes;
+
+		// The settings the pixels' sums, sample counts and converged flags depend on, which a resumed render must match
+		int32_t num_samples;
+		int32_t recursion_depth;
+		uint8_t sampling;
+		uint8_t ray_cones;
+		uint8_t adaptive_sampling;
+		int32_t min_samples;
+		int32_t samples_per_pass;
+		double target_relative_error;
+		uint8_t russian_roulette;
+		int32_t russian_roulette_min_bounces;
+		uint8_t next_event_estimation;
+	};
+
+	struct checkpoint_pixel
+	{
+		float sum[4];
+		double luminance_mean;
+		double luminance_m2;
+		int32_t samples;
+		uint8_t converged;
+	};
+#pragma pack(pop)
+
+	checkpoint_header make_checkpoint_header(int passes) const
+	{
+		checkpoint_header header = {};
+		std::copy(std::begin(checkpoint_magic), std::end(checkpoint_magic), header.magic);
+		header.version = checkpoint_version;
+		header.width = image_width;
+		header.height = image_height;
+		header.seed = seed;
+		header.passes = passes;
+		header.num_samples = num_samples;
+		header.recursion_depth = recursion_depth;
+		header.sampling = (uint8_t)sampling;
+		header.ray_cones = ray_cones;
+		header.adaptive_sampling = adaptive_sampling;
+		header.min_samples = min_samples;
+		header.samples_per_pass = samples_per_pass;
+		header.target_relative_error = target_relative_error;
+		header.russian_roulette = integrator.russian_roulette;
+		header.russian_roulette_min_bounces = integrator.russian_roulette_min_bounces;
+		header.next_event_estimation = integrator.next_event_estimation;
+		return header;
 	}
+
+	// Writes to a temporary file first so a job killed mid-write still leaves the previous checkpoint intact
+	void save_checkpoint(const accumulation_buffer& accumulation, int passes) const
+	{
+		const std::string temp_file = checkpoint_file + ".tmp";
+		{
+			std::ofstream file(temp_file, std::ios::binary | std::ios::trunc);
+
+			const checkpoint_header header = make_checkpoint_header(passes);
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+			std::vector<checkpoint_pixel> pixels(accumulation.size());
+			std::transform(accumulation.data(), accumulation.data() + accumulation.size(), pixels.begin(), [](const pixel_accumulator& pixel)
+				{
+					return checkpoint_pixel{
+						.sum = { pixel.sum.R, pixel.sum.G, pixel.sum.B, pixel.sum.A },
+						.luminance_mean = pixel.luminance_mean,
+						.luminance_m2 = pixel.luminance_m2,
+						.samples = pixel.samples,
+						.converged = pixel.converged,
+					};
+				});
+			file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(checkpoint_pixel));
+
+			if (!file)
+			{
+				std::cerr << "\nFailed to write checkpoint " << temp_file << '\n';
+				return;
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temp_file, checkpoint_file, error);
+		if (error)
+		{
+			std::cerr << "\nFailed to replace checkpoint " << checkpoint_file << ": " << error.message() << '\n';
+		}
+	}
+
+	// Returns false, leaving the buffer untouched, if there is no checkpoint or it doesn't match this render
+	bool load_checkpoint(accumulation_buffer& accumulation, int& passes) const
+	{
+		std::ifstream file(checkpoint_file, std::ios::binary);
+		if (!file)
+			return false;
+
+		checkpoint_header header;
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!file || !std::equal(std::begin(checkpoint_magic), std::end(checkpoint_magic), header.magic) || header.version != checkpoint_version)
+		{
+			std::cerr << "Ignoring checkpoint " << checkpoint_file << ", not a checkpoint file\n";
+			return false;
+		}
+		if (header.width != image_width || header.height != image_height || header.seed != seed)
+		{
+			std::cerr << "Ignoring checkpoint " << checkpoint_file << ", written for a different image size or seed\n";
+			return false;
+		}
+
+		// The header is packed, so it compares bytewise once the pass count, which may differ, is copied over
+		const checkpoint_header expected = make_checkpoint_header(header.passes);
+		if (std::memcmp(&header, &expected, sizeof(header)) != 0)
+		{
+			std::cerr << "Ignoring checkpoint " << checkpoint_file << ", written with different sampling or integrator settings\n";
+			return false;
+		}
+
+		std::vector<checkpoint_pixel> pixels(accumulation.size());
+		file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(checkpoint_pixel));
+		if (!file)
+		{
+			std::cerr << "Ignoring checkpoint " << checkpoint_file << ", file is truncated\n";
+			return false;
+		}
+
+		std::transform(pixels.begin(), pixels.end(), accumulation.data(), [](const checkpoint_pixel& pixel)
+			{
+				pixel_accumulator result;
+				result.sum = fRGBA(pixel.sum[0], pixel.sum[1], pixel.sum[2], pixel.sum[3]);
+				result.luminance_mean = pixel.luminance_mean;
+				result.luminance_m2 = pixel.luminance_m2;
+				result.samples = pixel.samples;
+				result.converged = pixel.converged != 0;
+				return result;
+			});
+		passes = header.passes;
+		return true;
+	}
+
+	struct tile
+	{
+		int x0, y0; // Top left pixel, inclusive
+		int x1, y1; // Bottom right pixel, exclusive
+	};
 };
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "common/math/random.h"
+#include "common/vectorclass/vector3d.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+
+enum class sampler_type
+{
+	random, // Independent pseudo-random numbers, whose error falls as 1 / sqrt(samples)
+	sobol,  // Owen scrambled Sobol points, stratified over each pixel's samples
+};
+
+// The numbers one sample of a pixel draws, one dimension at a time. Each get_1d() or get_2d() takes the
+// next dimension, and the integrator restarts from fixed dimensions with start_dimension() so every
+// sample of the pixel uses a dimension for the same decision.
+//
+// The Sobol sampler gives every dimension the first two dimensions of the Sobol sequence, which are a
+// (0, 2)-sequence: each power of two run of samples stratifies the unit square in every power of two
+// grid of that many cells. Each dimension shuffles the sample indices and Owen scrambles the points with
+// its own hash of the pixel, so dimensions and pixels are independent of each other while each stays
+// stratified (Burley 2020, "Practical Hash-based Owen Scrambling").
+class sampler
+{
+public:
+	sampler() = default;
+
+	// Sample sample_index of the pixel pixel_seed is mixed from. The random sampler draws from the
+	// calling thread's random sequence instead, which the renderer seeds for the pixel.
+	sampler(sampler_type type, uint64_t pixel_seed, uint32_t sample_index)
+		: type(type)
+		, pixel_seed(pixel_seed)
+		, reversed_index(reverse_bits(sample_index))
+	{
+	}
+
+	// Whether the pixel's samples are stratified, so nearby numbers in a dimension should map to nearby choices
+	bool stratified() const
+	{
+		return type != sampler_type::random;
+	}
+
+	void start_dimension(int dimension)
+	{
+		next_dimension = dimension;
+	}
+
+	// Uniform in [0, 1)
+	double get_1d()
+	{
+		if (type == sampler_type::random)
+			return random_double();
+
+		const uint32_t dimension_seed = (uint32_t)mix_seed(pixel_seed, next_dimension++);
+		const uint32_t index = shuffled_index(dimension_seed);
+		return reverse_bits(laine_karras_permutation(index, dimension_seed ^ 0x9e3779b9u)) * 0x1p-32;
+	}
+
+	// Uniform in [0, 1)^2
+	Vec2d get_2d()
+	{
+		if (type == sampler_type::random)
+		{
+			const double x = random_double();
+			return Vec2d(x, random_double());
+		}
+
+		const uint64_t dimension_seed = mix_seed(pixel_seed, next_dimension++);
+		const uint32_t index = shuffled_index((uint32_t)dimension_seed);
+		const uint32_t x = reverse_bits(laine_karras_permutation(index, (uint32_t)(dimension_seed >> 32)));
+		const uint32_t y = reverse_bits(laine_karras_permutation(reversed_sobol_second_dimension(index), (uint32_t)(dimension_seed >> 32) ^ 0x9e3779b9u));
+		return Vec2d(x * 0x1p-32, y * 0x1p-32);
+	}
+
+private:
+	static constexpr uint32_t reverse_bits(uint32_t x)
+	{
+		x = (x << 16) | (x >> 16);
+		x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+		x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+		x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+		x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+		return x;
+	}
+
+	// Hashes x so each bit only depends on the bits below it and the seed, an Owen scramble of the bits
+	// taken from the lowest up (Laine and Karras, with Vegdahl's constants)
+	static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+	{
+		x ^= x * 0x3d20adeau;
+		x += seed;
+		x *= (seed >> 16) | 1;
+		x ^= x * 0x05526c56u;
+		x ^= x * 0x53a22864u;
+		return x;
+	}
+
+	// The sample index Owen scrambled as a fraction in [0, 1), each bit depending only on the bits above it.
+	// Runs of a power of two samples stay runs of the same length, in a different order.
+	uint32_t shuffled_index(uint32_t seed) const
+	{
+		return reverse_bits(laine_karras_permutation(reversed_index, seed));
+	}
+
+	// The first dimension of the Sobol sequence is index with its bits reversed, this is the second with its
+	// bits reversed, ready to scramble. It's the xor of a direction number for each set bit of index, which
+	// for every byte of index is looked up at once.
+	static uint32_t reversed_sobol_second_dimension(uint32_t index)
+	{
+		static constexpr std::array<std::array<uint32_t, 256>, 4> byte_directions = []()
+		{
+			std::array<std::array<uint32_t, 256>, 4> tables = {};
+			uint32_t v = 1u << 31;
+			for (int bit = 0; bit < 32; ++bit, v ^= v >> 1)
+			{
+				for (int byte = 0; byte < 256; ++byte)
+				{
+					if (byte & (1 << bit % 8))
+						tables[bit / 8][byte] ^= reverse_bits(v);
+				}
+			}
+			return tables;
+		}();
+
+		return byte_directions[0][index & 0xff] ^ byte_directions[1][index >> 8 & 0xff] ^ byte_directions[2][index >> 16 & 0xff] ^ byte_directions[3][index >> 24];
+	}
+
+	sampler_type type = sampler_type::random;
+	uint64_t pixel_seed = 0;
+	uint32_t reversed_index = 0;
+	int next_dimension = 0;
+};
+
+// The point on the unit sphere u maps to, uniform over the sphere for uniform u
+inline Vec3Dd sphere_point(Vec2d u)
+{
+	const double z = 1 - 2 * u[0];
+	const double radius = std::sqrt(std::max(1 - z * z, 0.0));
+	const double phi = 2 * std::numbers::pi * u[1];
+	return Vec3Dd(radius * std::cos(phi), radius * std::sin(phi), z);
+}
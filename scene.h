@@ -1,47 +1,298 @@
 #pragma once
 
+#include <algorithm>
+#include <iostream>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include "bvh.h"
+#include "sampler.h"
 #include "traceable.h"
 
-class scene
+struct integrator_settings
+{
+	// Russian roulette ends a path at random once it has taken russian_roulette_min_bounces bounces,
+	// surviving with probability equal to its brightest throughput channel (at most 0.95). Surviving
+	// paths divide their throughput by that probability, so the estimate stays unbiased.
+	bool russian_roulette = false;
+	int russian_roulette_min_bounces = 3;
+
+	// Next-event estimation samples the sky with a shadow ray at every hit whose material can be lit, and
+	// multiple importance sampling weighs those samples and the sky the path reaches by scattering against
+	// each other with the power heuristic, so bright parts of the sky no longer turn into fireflies.
+	bool next_event_estimation = true;
+};
+
+struct material;
+
+// Objects traced in the precision of T. Materials shade in double precision either way.
+template <typename T>
+class basic_scene
 {
 public:
-	std::optional<ray_intersection> ray_intersect(const ray& r) const
+	using packet = typename vector_types<T>::packet;
+	using packet_mask = typename vector_types<T>::packet_mask;
+	static constexpr int packet_size = basic_ray_packet<T>::size;
+
+	// Closest intersection, written to hit. Returns false if the ray escapes.
+	bool ray_intersect(const basic_ray<T>& r, basic_ray_intersection<T>& hit) const
 	{
-		std::optional<ray_intersection> result;
-		for (auto&& object : objects)
+		prepare();
+
+		// Each object only writes to hit if it is closer than every hit so far
+		bool found = false;
+		acceleration.object_bvh.traverse(r, 0, std::numeric_limits<T>::infinity(), [&](int object_index, T& t_max)
+			{
+				if (objects[object_index]->ray_intersect(r, 0, t_max, hit))
+				{
+					t_max = hit.t;
+					found = true;
+				}
+			});
+		return found;
+	}
+
+	// Whether anything is hit with t in [t_min, t_max], stopping at the first hit found.
+	// Cheaper than ray_intersect for shadow and visibility rays, which don't need to know what they hit.
+	bool occluded(const basic_ray<T>& r, T t_min, T t_max) const
+	{
+		prepare();
+
+		return acceleration.object_bvh.traverse_any(r, t_min, t_max, [&](int object_index)
+			{
+				return objects[object_index]->occluded(r, t_min, t_max);
+			});
+	}
+
+	// Closest intersection for each ray of the packet, written to hits for the rays the result is true for.
+	// The packet only finds which object each ray hits, the intersections are then made for those rays alone.
+	std::array<bool, packet_size> ray_intersect(const basic_ray_packet<T>& rays, basic_ray_intersection<T> (&hits)[packet_size]) const
+	{
+		prepare();
+
+		packet t_max = std::numeric_limits<T>::infinity();
+		int hit_objects[packet_size];
+		std::fill_n(hit_objects, packet_size, -1);
+		acceleration.object_bvh.traverse(rays, 0, t_max, [&](int object_index, packet& t_max)
+			{
+				const packet t = objects[object_index]->ray_distances(rays, 0, t_max);
+				const packet_mask hit = t <= t_max && t != std::numeric_limits<T>::infinity();
+				if (horizontal_or(hit))
+				{
+					for (int i = 0; i < packet_size; ++i)
+					{
+						if (hit[i])
+							hit_objects[i] = object_index;
+					}
+					t_max = select(hit, t, t_max);
+				}
+			});
+
+		std::array<bool, packet_size> found = {};
+		for (int i = 0; i < rays.count; ++i)
 		{
-			auto temp = object->ray_intersect(r);
-			if (temp.has_value() && (!result.has_value() || temp->t < result->t))
-				result = temp;
+			found[i] = hit_objects[i] >= 0;
+			if (found[i])
+				objects[hit_objects[i]]->make_intersection(rays.rays[i], 0, t_max[i], hits[i]);
 		}
-		return result;
+		return found;
+	}
+
+	// Index of mat in materials, adding it if it isn't there yet. Must not be called once the scene has been rendered.
+	int add_material(const std::shared_ptr<material>& mat)
+	{
+		const auto existing = std::find(materials.begin(), materials.end(), mat);
+		if (existing != materials.end())
+			return (int)(existing - materials.begin());
+
+		materials.push_back(mat);
+		return (int)materials.size() - 1;
 	}
 
-	fRGBA ray_colour(const ray& r) const;
+	// Builds the BVH over objects, which ray_intersect does itself on first use.
+	// Renderers call it up front to keep the build out of the render threads.
+	void prepare() const
+	{
+		std::call_once(acceleration.built, [this]()
+			{
+				std::vector<basic_aabb<T>> object_bounds(objects.size());
+				std::transform(objects.begin(), objects.end(), object_bounds.begin(), [](const std::shared_ptr<basic_traceable<T>>& object) { return object->bounds(); });
+				const typename basic_bvh<T>::build_stats stats = acceleration.object_bvh.build(object_bounds);
+				std::cout << "Built BVH over " << objects.size() << " objects in " << stats.seconds << "s: " << stats.node_count << " nodes, depth " << stats.depth
+					<< ", leaves of " << stats.average_leaf_size << " average and " << stats.largest_leaf << " largest, SAH cost " << stats.sah_cost << '\n';
+			});
+	}
+
+	// Sampler dimensions the camera ray is made from, before the integrator's. Each bounce then draws from
+	// bounce_dimensions of its own, whichever material it hits: one each for scattering, next-event
+	// estimation and Russian roulette.
+	static constexpr int camera_dimensions = 1;
+	static constexpr int bounce_dimensions = 3;
+
+	// Iterative path integrator: follows the path from r until it escapes to the sky, is absorbed or runs out of depth.
+	// Draws the path's numbers from s. Adds the number of rays traced along the way to ray_count.
+	fRGBA ray_colour(basic_ray<T> r, const integrator_settings& settings, sampler& s, long long& ray_count) const;
+
+	// Traces the first rays of the packet's paths together, then follows each path on its own, drawing from
+	// the sampler of the same index. Only the first rays.count colours are valid.
+	std::array<fRGBA, packet_size> ray_colour(const basic_ray_packet<T>& rays, const integrator_settings& settings, std::span<sampler> samplers, long long& ray_count) const;
+
+private:
+	// Continues the path from hit, what ray r hit if has_hit. The rest of the path's hits are written to hit too.
+	fRGBA path_colour(basic_ray<T> r, basic_ray_intersection<T>& hit, bool has_hit, const integrator_settings& settings, sampler& s, long long& ray_count) const;
+
+	// Next-event estimate of the sky light reaching hit, which ray r made on mat, MIS weighted
+	fRGBA sky_light(const ray& r, const ray_intersection& hit, const material& mat, sampler& s, long long& ray_count) const;
 
 public:
-	std::vector<std::shared_ptr<traceable>> objects;
+	std::vector<std::shared_ptr<basic_traceable<T>>> objects; // Must not change once the scene has been rendered
+	std::vector<std::shared_ptr<material>> materials; // The objects refer to these by index, the only references hits hold
 	std::shared_ptr<material> sky_material;
+
+	// Built from objects by prepare(), public only so scenes can stay aggregates
+	struct acceleration_structure
+	{
+		std::once_flag built;
+		basic_bvh<T> object_bvh;
+	};
+	mutable acceleration_structure acceleration;
 };
 
+using scene = basic_scene<double>;
+
 #include "material.h"
 
-fRGBA scene::ray_colour(const ray& r) const
+template <typename T>
+fRGBA basic_scene<T>::ray_colour(basic_ray<T> r, const integrator_settings& settings, sampler& s, long long& ray_count) const
+{
+	if (r.remaining_depth <= 0)
+		return fRGBA(0, 0, 0, 1);
+
+	++ray_count;
+	basic_ray_intersection<T> hit;
+	const bool has_hit = ray_intersect(r, hit);
+	return path_colour(r, hit, has_hit, settings, s, ray_count);
+}
+
+template <typename T>
+std::array<fRGBA, basic_scene<T>::packet_size> basic_scene<T>::ray_colour(const basic_ray_packet<T>& rays, const integrator_settings& settings, std::span<sampler> samplers, long long& ray_count) const
 {
-	if (r.remaining_depth == 0)
-		return fRGBA(0, 0, 0);
+	std::array<fRGBA, packet_size> colours;
+	colours.fill(fRGBA(0, 0, 0, 1));
+	if (rays.rays[0].remaining_depth <= 0)
+		return colours;
 
-	auto t = ray_intersect(r);
-	return *t.and_then([&, &sc=*this](const ray_intersection& ri) -> std::optional<fRGBA>
+	ray_count += rays.count;
+	basic_ray_intersection<T> hits[packet_size];
+	const std::array<bool, packet_size> has_hits = ray_intersect(rays, hits);
+
+	// The rays that miss see nothing but the sky, which is looked up for them together
+	Vec3Dd sky_directions[packet_size];
+	int sky_rays[packet_size];
+	int sky_count = 0;
+	for (int i = 0; i < rays.count; ++i)
+	{
+		if (has_hits[i])
 		{
-			Vec3Dd N = ri.normal;
-			fRGBA C = ri.mat->sample(sc, ri);
-			return C;
-		}).or_else([&, &sc = *this]() -> std::optional<fRGBA>
+			colours[i] = path_colour(rays.rays[i], hits[i], true, settings, samplers[i], ray_count);
+		}
+		else
+		{
+			sky_rays[sky_count] = i;
+			sky_directions[sky_count++] = convert_vector<double>(rays.rays[i].direction);
+		}
+	}
+
+	fRGBA sky[packet_size];
+	sky_material->sky_emitted(std::span(sky_directions, sky_count), std::span(sky, sky_count));
+	for (int i = 0; i < sky_count; ++i)
+	{
+		colours[sky_rays[i]] = sky[i];
+		colours[sky_rays[i]].A = 1.0f;
+	}
+	return colours;
+}
+
+template <typename T>
+fRGBA basic_scene<T>::path_colour(basic_ray<T> r, basic_ray_intersection<T>& hit, bool has_hit, const integrator_settings& settings, sampler& s, long long& ray_count) const
+{
+	fRGBA throughput(1, 1, 1, 1);
+	fRGBA radiance(0, 0, 0, 0);
+	double scatter_pdf = 0; // Of the last bounce if the sky was also sampled there, else 0 for the sky to count in full
+
+	for (int bounce = 1; ; ++bounce)
+	{
+		const ray& r_double = double_ray(r);
+		if (!has_hit)
+		{
+			float weight = 1;
+			if (scatter_pdf > 0)
+			{
+				const double light_pdf = sky_material->emission_pdf(normalize_vector(r_double.direction));
+				weight = (float)(scatter_pdf * scatter_pdf / (scatter_pdf * scatter_pdf + light_pdf * light_pdf));
+			}
+			radiance += throughput * sky_material->emitted(r_double, ray_intersection{}) * weight;
+			break;
+		}
+
+		const material& mat = *materials[hit.material];
+		const ray_intersection& hit_double = double_intersection(hit);
+		const int dimension = camera_dimensions + (bounce - 1) * bounce_dimensions;
+		radiance += throughput * mat.emitted(r_double, hit_double);
+		if (settings.next_event_estimation && mat.has_diffuse_lobe())
 		{
-			auto sample = sky_material->sample(sc, { .r = r });
-			return sample;
-		});
+			s.start_dimension(dimension + 1);
+			radiance += throughput * sky_light(r_double, hit_double, mat, s, ray_count);
+		}
+
+		s.start_dimension(dimension);
+		const std::optional<scatter_record> scattered = mat.scatter(r_double, hit_double, s);
+		if (!scattered)
+			break;
+
+		scatter_pdf = settings.next_event_estimation ? scattered->pdf : 0;
+		throughput *= scattered->attenuation;
+		r = convert_ray<T>(scattered->scattered);
+		if (r.remaining_depth <= 0)
+			break;
+
+		if (settings.russian_roulette && bounce >= settings.russian_roulette_min_bounces)
+		{
+			const float survival = std::min(std::max({ throughput.R, throughput.G, throughput.B }), 0.95f);
+			s.start_dimension(dimension + 2);
+			if (s.get_1d() >= survival)
+				break;
+
+			throughput /= survival;
+		}
+
+		++ray_count;
+		has_hit = ray_intersect(r, hit);
+	}
+
+	radiance.A = 1.0f;
+	return radiance;
+}
+
+template <typename T>
+fRGBA basic_scene<T>::sky_light(const ray& r, const ray_intersection& hit, const material& mat, sampler& s, long long& ray_count) const
+{
+	Vec3Dd direction;
+	double light_pdf;
+	if (!sky_material->sample_emission(direction, light_pdf, s) || !(light_pdf > 0))
+		return fRGBA(0, 0, 0, 0);
+
+	// Directions behind the surface can't light it, so they need no shadow ray
+	double scatter_pdf;
+	const fRGBA f = mat.evaluate(r, hit, direction, scatter_pdf);
+	if (!(scatter_pdf > 0))
+		return fRGBA(0, 0, 0, 0);
+
+	const ray shadow_ray = r.scatter(hit, direction);
+	++ray_count;
+	if (occluded(convert_ray<T>(shadow_ray), 0, std::numeric_limits<T>::infinity()))
+		return fRGBA(0, 0, 0, 0);
+
+	const double weight = light_pdf * light_pdf / (light_pdf * light_pdf + scatter_pdf * scatter_pdf);
+	return f * sky_material->emitted(shadow_ray, ray_intersection{}) * (float)(weight / light_pdf);
 }
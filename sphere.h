@@ -2,12 +2,17 @@
 
 #include "traceable.h"
 
-class sphere : public traceable
+template <typename T>
+class basic_sphere : public basic_traceable<T>
 {
 public:
-    std::optional<ray_intersection> ray_intersect(const ray& r)
+    using vec3 = vec3_t<T>;
+    using packet = typename vector_types<T>::packet;
+    using packet_mask = typename vector_types<T>::packet_mask;
+
+    bool ray_intersect(const basic_ray<T>& r, T t_min, T t_max, basic_ray_intersection<T>& hit) const
     {
-        Vec3Dd oc = r.origin - center;
+        vec3 oc = r.origin - center;
         auto a = dot_product(r.direction, r.direction); // 1 if normalised ray
         auto b_2 = dot_product(oc, r.direction); // half of b
         auto c = dot_product(oc, oc) - radius * radius;
@@ -15,43 +20,89 @@ public:
 
         if (d_4 < 0)
         {
-            return std::nullopt;
+            return false;
         }
 
         // (-b - sqrt(d)) / 2a
         // but we cancel the 2 by using half b and sqrt(quarter d) aka half sqrt(d)
-        double t = (-b_2 - sqrt(d_4)) / a;
+        T t = (-b_2 - sqrt(d_4)) / a;
 
         // Find the nearest root that lies in the acceptable range.
-        double t_min = 0, t_max = std::numeric_limits<double>::infinity();
         if (t < t_min || t > t_max)
         {
             t = (-b_2 + sqrt(d_4)) / a;
             if (t < t_min || t > t_max)
             {
-                return std::nullopt;
+                return false;
             }
         }
 
-        Vec3Dd location = r.at(t);
-        Vec3Dd normal = (location - center) / radius;
-        return ray_intersection{
-            .location = location,
-            .normal = normal,
-            .texcoord = Vec2d(normal[0] + 1, normal[1] + 1) * 0.5,
-            .mat = mat,
-            .r = r,
-            .t = t,
-        };
+        make_intersection(r, t_min, t, hit);
+        return true;
+    }
+
+    bool occluded(const basic_ray<T>& r, T t_min, T t_max) const
+    {
+        vec3 oc = r.origin - center;
+        auto a = dot_product(r.direction, r.direction);
+        auto b_2 = dot_product(oc, r.direction);
+        auto c = dot_product(oc, oc) - radius * radius;
+        auto d_4 = b_2 * b_2 - a * c;
+        if (d_4 < 0)
+            return false;
+
+        const T t_near = (-b_2 - sqrt(d_4)) / a;
+        const T t_far = (-b_2 + sqrt(d_4)) / a;
+        return (t_near >= t_min && t_near <= t_max) || (t_far >= t_min && t_far <= t_max);
+    }
+
+    void make_intersection(const basic_ray<T>& r, T t_min, T t, basic_ray_intersection<T>& hit) const
+    {
+        hit.location = r.at(t);
+        const vec3 outward = (hit.location - center) / radius;
+        hit.set_normal(r, outward, outward);
+        hit.texcoord = Vec2d(outward[0] + 1, outward[1] + 1) * 0.5;
+        hit.texcoord_footprint = r.cone_width_at(t) * 0.5f / (float)std::abs(radius); // texcoord moves half as fast as the normal
+        hit.material = material;
+        hit.t = t;
+    }
+
+    packet ray_distances(const basic_ray_packet<T>& rays, T t_min, const packet& t_max) const
+    {
+        // The same quadratic for every ray at once
+        const packet oc_x = rays.origin[0] - center.get_x();
+        const packet oc_y = rays.origin[1] - center.get_y();
+        const packet oc_z = rays.origin[2] - center.get_z();
+        const packet a = rays.direction[0] * rays.direction[0] + rays.direction[1] * rays.direction[1] + rays.direction[2] * rays.direction[2];
+        const packet b_2 = oc_x * rays.direction[0] + oc_y * rays.direction[1] + oc_z * rays.direction[2];
+        const packet c = oc_x * oc_x + oc_y * oc_y + oc_z * oc_z - radius * radius;
+        const packet d_4 = b_2 * b_2 - a * c;
+        const packet_mask has_roots = d_4 >= 0;
+
+        const packet sqrt_d_4 = sqrt(max(d_4, packet(0)));
+        const packet t_near = (-b_2 - sqrt_d_4) / a;
+        const packet t_far = (-b_2 + sqrt_d_4) / a;
+        const packet t = select(t_near >= t_min && t_near <= t_max, t_near, t_far);
+        return select(has_roots && t >= t_min && t <= t_max, t, packet(std::numeric_limits<T>::infinity()));
+    }
+
+    basic_aabb<T> bounds() const
+    {
+        // Negative radii turn the sphere inside out but it covers the same space
+        const vec3 half_size = vec3(1, 1, 1) * std::abs(radius);
+        return basic_aabb<T>{ .min = center - half_size, .max = center + half_size };
     }
 
 public:
-    Vec3Dd center;
-    double radius;
-    std::shared_ptr<material> mat;
+    vec3 center;
+    T radius;
+    int material; // Index into the scene's materials
 
-    sphere(const Vec3Dd& center, double radius, const std::shared_ptr<material>& mat)
-        : center(center), radius(radius), mat(mat)
+    // Scenes are described in double precision whatever precision they're traced in
+    basic_sphere(const Vec3Dd& center, double radius, int material)
+        : center(convert_vector<T>(center)), radius((T)radius), material(material)
     {
     }
 };
+
+using sphere = basic_sphere<double>;
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "bvh.h"
+#include "traceable.h"
+
+// Many spheres as one traceable, stored structure-of-arrays in packets of packet_size so one ray
+// is tested against a whole packet at once. Packets are filled in BVH order so each holds spheres
+// that are close together, and a BVH over the packets picks the ones the ray needs to test.
+// Packets hold one sphere per lane of a packet vector: 4 in double precision, 8 in single.
+template <typename T>
+class basic_sphere_set : public basic_traceable<T>
+{
+public:
+    using aabb = basic_aabb<T>;
+    using vec3 = vec3_t<T>;
+    using packet = typename vector_types<T>::packet;
+    using packet_mask = typename vector_types<T>::packet_mask;
+    static constexpr int packet_size = packet::size();
+
+    // Must not be called once the set has been traced or its bounds taken
+    void add(const Vec3Dd& center, double radius, int material)
+    {
+        spheres.push_back({ convert_vector<T>(center), (T)radius, material });
+    }
+
+    bool ray_intersect(const basic_ray<T>& r, T t_min, T t_max, basic_ray_intersection<T>& hit) const
+    {
+        prepare();
+
+        const packet origin[3] = { packet(r.origin.get_x()), packet(r.origin.get_y()), packet(r.origin.get_z()) };
+        const packet direction[3] = { packet(r.direction.get_x()), packet(r.direction.get_y()), packet(r.direction.get_z()) };
+        const T a = dot_product(r.direction, r.direction); // 1 if normalised ray
+
+        int hit_packet = -1;
+        int hit_lane = 0;
+        T hit_t = 0;
+        packet_bvh.traverse(r, t_min, t_max, [&](int packet_index, T& t_limit)
+            {
+                const packet t_hit = sphere_distances(packets[packet_index], origin, direction, a, t_min, t_limit);
+                const T closest = horizontal_min(t_hit);
+                if (closest != std::numeric_limits<T>::infinity())
+                {
+                    t_limit = closest;
+                    hit_t = closest;
+                    hit_packet = packet_index;
+                    hit_lane = horizontal_find_first(t_hit == packet(closest));
+                }
+            });
+
+        if (hit_packet < 0)
+        {
+            return false;
+        }
+
+        // Only the closest hit becomes a full intersection
+        const sphere_packet& p = packets[hit_packet];
+        const vec3 center(p.center_x[hit_lane], p.center_y[hit_lane], p.center_z[hit_lane]);
+        hit.location = r.at(hit_t);
+        const vec3 outward = (hit.location - center) / p.radius[hit_lane];
+        hit.set_normal(r, outward, outward);
+        hit.texcoord = Vec2d(outward[0] + 1, outward[1] + 1) * 0.5;
+        hit.texcoord_footprint = r.cone_width_at(hit_t) * 0.5f / (float)std::abs(p.radius[hit_lane]); // texcoord moves half as fast as the normal
+        hit.material = p.material[hit_lane];
+        hit.t = hit_t;
+        return true;
+    }
+
+    bool occluded(const basic_ray<T>& r, T t_min, T t_max) const
+    {
+        prepare();
+
+        const packet origin[3] = { packet(r.origin.get_x()), packet(r.origin.get_y()), packet(r.origin.get_z()) };
+        const packet direction[3] = { packet(r.direction.get_x()), packet(r.direction.get_y()), packet(r.direction.get_z()) };
+        const T a = dot_product(r.direction, r.direction);
+
+        return packet_bvh.traverse_any(r, t_min, t_max, [&](int packet_index)
+            {
+                return horizontal_min(sphere_distances(packets[packet_index], origin, direction, a, t_min, t_max)) != std::numeric_limits<T>::infinity();
+            });
+    }
+
+    aabb bounds() const
+    {
+        prepare();
+        return packet_bvh.empty() ? aabb() : packet_bvh.bounds();
+    }
+
+    // Packs the spheres and builds the BVH over the packets, which ray_intersect and bounds do themselves on first use
+    void prepare() const
+    {
+        std::call_once(built, [this]() { build(); });
+    }
+
+    size_t size() const
+    {
+        return spheres.size();
+    }
+
+private:
+    struct sphere_data
+    {
+        vec3 center;
+        T radius;
+        int material;
+    };
+
+    struct sphere_packet
+    {
+        packet center_x;
+        packet center_y;
+        packet center_z;
+        packet radius;
+        int material[packet_size]; // Index into the scene's materials
+    };
+
+    // Distance the ray hits each sphere of p at within [t_min, t_max], infinity in the lanes it misses.
+    // Same quadratic as sphere::ray_intersect, with half b and a quarter of the discriminant.
+    static packet sphere_distances(const sphere_packet& p, const packet (&origin)[3], const packet (&direction)[3], T a, T t_min, T t_max)
+    {
+        const packet oc_x = origin[0] - p.center_x;
+        const packet oc_y = origin[1] - p.center_y;
+        const packet oc_z = origin[2] - p.center_z;
+        const packet b_2 = oc_x * direction[0] + oc_y * direction[1] + oc_z * direction[2];
+        const packet c = oc_x * oc_x + oc_y * oc_y + oc_z * oc_z - p.radius * p.radius;
+        const packet d_4 = b_2 * b_2 - a * c;
+        const packet_mask has_roots = d_4 >= 0; // False for the NaN padding lanes too
+
+        // Nearest root in range, else the far one
+        const packet sqrt_d_4 = sqrt(max(d_4, packet(0)));
+        const packet t_near = (-b_2 - sqrt_d_4) / a;
+        const packet t_far = (-b_2 + sqrt_d_4) / a;
+        const packet t = select(t_near >= t_min && t_near <= t_max, t_near, t_far);
+        return select(has_roots && t >= t_min && t <= t_max, t, packet(std::numeric_limits<T>::infinity()));
+    }
+
+    static aabb sphere_bounds(const vec3& center, T radius)
+    {
+        // Negative radii turn the sphere inside out but it covers the same space
+        const vec3 half_size = vec3(1, 1, 1) * std::abs(radius);
+        return aabb{ .min = center - half_size, .max = center + half_size };
+    }
+
+    void build() const
+    {
+        std::vector<aabb> bounds(spheres.size());
+        std::transform(spheres.begin(), spheres.end(), bounds.begin(), [](const sphere_data& s) { return sphere_bounds(s.center, s.radius); });
+
+        basic_bvh<T> sphere_bvh;
+        sphere_bvh.build(bounds);
+        const std::span<const int> order = sphere_bvh.primitive_order();
+
+        // Lanes past the last sphere get a NaN center, which never has roots
+        const int packet_count = (int)(spheres.size() + packet_size - 1) / packet_size;
+        packets.resize(packet_count);
+        std::vector<aabb> packet_bounds(packet_count);
+        for (int i = 0; i < packet_count; ++i)
+        {
+            T center_x[packet_size], center_y[packet_size], center_z[packet_size], radius[packet_size];
+            for (int lane = 0; lane < packet_size; ++lane)
+            {
+                const size_t sphere_index = (size_t)i * packet_size + lane;
+                if (sphere_index < order.size())
+                {
+                    const sphere_data& s = spheres[order[sphere_index]];
+                    center_x[lane] = s.center.get_x();
+                    center_y[lane] = s.center.get_y();
+                    center_z[lane] = s.center.get_z();
+                    radius[lane] = s.radius;
+                    packets[i].material[lane] = s.material;
+                    packet_bounds[i].grow(bounds[order[sphere_index]]);
+                }
+                else
+                {
+                    center_x[lane] = center_y[lane] = center_z[lane] = std::numeric_limits<T>::quiet_NaN();
+                    radius[lane] = 0;
+                    packets[i].material[lane] = 0;
+                }
+            }
+            packets[i].center_x.load(center_x);
+            packets[i].center_y.load(center_y);
+            packets[i].center_z.load(center_z);
+            packets[i].radius.load(radius);
+        }
+
+        packet_bvh.build(packet_bounds);
+    }
+
+    std::vector<sphere_data> spheres;
+
+    // Built from spheres by prepare()
+    mutable std::once_flag built;
+    mutable std::vector<sphere_packet> packets;
+    mutable basic_bvh<T> packet_bvh;
+};
+
+using sphere_set = basic_sphere_set<double>;
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs tasks on a pool of threads that each own a deque of tasks.
+// A worker pops from the back of its own deque, which holds the work it split off most recently,
+// and once that is empty steals from the front of another worker's deque, where the oldest and
+// largest pieces of work sit. Tasks may push more tasks, so a worker that is stuck on an
+// expensive task can hand parts of it to idle workers.
+template<typename task_t>
+class work_stealing_scheduler
+{
+	struct alignas(64) worker_queue
+	{
+		std::mutex mutex;
+		std::deque<task_t> tasks;
+	};
+
+public:
+	class context
+	{
+	public:
+		// Queues a task on this worker's deque, where idle workers can steal it
+		void push(task_t task)
+		{
+			scheduler.push(index, std::move(task));
+		}
+
+		// True if any worker is currently out of work, used to decide whether splitting a task is worth it
+		bool has_idle_workers() const
+		{
+			return scheduler.idle_workers.load(std::memory_order_relaxed) > 0;
+		}
+
+		int worker_index() const
+		{
+			return index;
+		}
+
+	private:
+		friend class work_stealing_scheduler;
+
+		context(work_stealing_scheduler& scheduler, int index)
+			: scheduler(scheduler), index(index)
+		{
+		}
+
+		work_stealing_scheduler& scheduler;
+		int index;
+	};
+
+	explicit work_stealing_scheduler(int num_threads)
+		: num_workers(std::max(num_threads, 1))
+		, queues(std::make_unique<worker_queue[]>(num_workers))
+	{
+	}
+
+	int worker_count() const
+	{
+		return num_workers;
+	}
+
+	// Queues a task on the given worker before run() starts, used to hand out the initial split of the work
+	void push(int worker, task_t task)
+	{
+		pending.fetch_add(1, std::memory_order_relaxed);
+		worker_queue& queue = queues[worker];
+		std::lock_guard lock(queue.mutex);
+		queue.tasks.push_back(std::move(task));
+	}
+
+	// Calls fn(task, context&) for every queued task and every task those push in turn,
+	// returning once all of them have completed. The calling thread acts as worker 0.
+	template<typename fn_t>
+	void run(fn_t&& fn)
+	{
+		auto worker = [&](int index)
+		{
+			context ctx(*this, index);
+			bool idle = false;
+			while (pending.load(std::memory_order_acquire) > 0)
+			{
+				std::optional<task_t> task = pop(index);
+				if (!task)
+				{
+					task = steal(index);
+				}
+
+				if (!task)
+				{
+					if (!idle)
+					{
+						idle = true;
+						idle_workers.fetch_add(1, std::memory_order_relaxed);
+					}
+					std::this_thread::yield();
+					continue;
+				}
+
+				if (idle)
+				{
+					idle = false;
+					idle_workers.fetch_sub(1, std::memory_order_relaxed);
+				}
+
+				fn(*task, ctx);
+				pending.fetch_sub(1, std::memory_order_release);
+			}
+
+			if (idle)
+			{
+				idle_workers.fetch_sub(1, std::memory_order_relaxed);
+			}
+		};
+
+		std::vector<std::jthread> threads;
+		threads.reserve(num_workers - 1);
+		for (int i = 1; i < num_workers; ++i)
+		{
+			threads.emplace_back(worker, i);
+		}
+		worker(0);
+	}
+
+private:
+	std::optional<task_t> pop(int index)
+	{
+		worker_queue& queue = queues[index];
+		std::lock_guard lock(queue.mutex);
+		if (queue.tasks.empty())
+			return std::nullopt;
+
+		task_t task = std::move(queue.tasks.back());
+		queue.tasks.pop_back();
+		return task;
+	}
+
+	std::optional<task_t> steal(int thief)
+	{
+		for (int i = 1; i < num_workers; ++i)
+		{
+			worker_queue& queue = queues[(thief + i) % num_workers];
+			std::lock_guard lock(queue.mutex);
+			if (!queue.tasks.empty())
+			{
+				task_t task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+				return task;
+			}
+		}
+		return std::nullopt;
+	}
+
+	int num_workers;
+	std::unique_ptr<worker_queue[]> queues;
+	std::atomic<int> pending = 0;      // Tasks queued or running
+	std::atomic<int> idle_workers = 0; // Workers that found no task on their last attempt
+};
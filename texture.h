@@ -1,7 +1,12 @@
 #pragma once
 
-#include "common/mdspan/mdarray"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
 #include "common/vectorclass/vector3d.h"
+#include "common/vectorclass/vectorfp16.h"
 #include "common/math/colour.h"
 #include "common/math/colour_transforms.h"
 
@@ -13,73 +18,361 @@ struct texture
 {
 	virtual ~texture() {}
 	virtual fRGBA sample(Vec2d coords) const = 0;
+
+	// Filtered over footprint, the width of the area to cover in texture coordinates, which textures
+	// with mip maps use to pick the level. A footprint of 0 samples like sample(coords).
+	virtual fRGBA sample(Vec2d coords, float footprint) const
+	{
+		return sample(coords);
+	}
+
+	// Size in texels, which sample() filters between
+	virtual int width() const = 0;
+	virtual int height() const = 0;
 };
 
+// Linear RGBA in half precision floats, for HDR textures in half the memory of fRGBA
+struct hRGBA
+{
+	static const int num_channels = 4;
+
+	Float16 R;
+	Float16 G;
+	Float16 B;
+	Float16 A;
+};
+
+// Two half precision colours widened at once, low in the low half of the result
+inline Vec8f widen(const hRGBA& low, const hRGBA& high)
+{
+	uint64_t bits[2];
+	std::memcpy(&bits[0], &low, sizeof(hRGBA));
+	std::memcpy(&bits[1], &high, sizeof(hRGBA));
+	return to_float(Vec8h(reinterpret_h(Vec2uq().load(bits))));
+}
+
+// Linear colour of a texel, 8-bit texels are sRGB
+template<typename colour_t>
+fRGBA decode_texel(const colour_t& colour)
+{
+	if constexpr (std::is_same_v<colour_t, hRGBA>)
+	{
+		fRGBA result;
+		widen(colour, colour).get_low().store(&result.R);
+		return result;
+	}
+	else
+	{
+		return convert<fRGBA>(colour);
+	}
+}
+
+template<typename colour_t>
+colour_t encode_texel(const fRGBA& colour)
+{
+	if constexpr (std::is_same_v<colour_t, hRGBA>)
+	{
+		colour_t result[2];
+		to_float16(Vec8f(Vec4f().load(&colour.R), Vec4f(0.0f))).store(result);
+		return result[0];
+	}
+	else if constexpr (std::is_same_v<colour_t, fRGBA>)
+	{
+		return colour;
+	}
+	else
+	{
+		return colour_t(linear_to_sRGB(colour));
+	}
+}
+
+// The four texels a bilinear lookup blends: corners holds x0, y0, x1 and y1, fraction how far
+// the lookup is from x0 towards x1 and from y0 towards y1
+struct bilinear_taps
+{
+	Vec4i corners;
+	Vec2d fraction;
+
+	// Taps in a size_x x size_y image, coordinates are clamped to the edges or wrapped around per axis
+	bilinear_taps(Vec2d coords, int size_x, int size_y, Vec2db wrap_xy)
+	{
+		const Vec2d scaled_coords = select(wrap_xy,
+			minimum(maximum(coords * Vec2d(size_x, size_y), Vec2d(0.0)), Vec2d(size_x - 1, size_y - 1)),
+			fmodulo(coords, 1.0) * Vec2d(size_x, size_y));
+		const Vec4i ic = truncate_to_int32(scaled_coords);
+		// Wrapped coordinates can round up to one texel past the edge, which is the first texel again
+		const Vec4i ic2_unwrapped = truncate_to_int32(ceil(scaled_coords));
+		const Vec4i ic2 = select(ic2_unwrapped >= Vec4i(size_x, size_y, 1, 1), ic2_unwrapped - Vec4i(size_x, size_y, 0, 0), ic2_unwrapped);
+		corners = blend4<0, 1, 4, 5>(ic, ic2);
+		fraction = scaled_coords - truncate(scaled_coords);
+	}
+
+	// Blend of the texels at (x0, y0), (x1, y0), (x0, y1) and (x1, y1)
+	template<typename colour_t>
+	fRGBA blend(const colour_t& texel00, const colour_t& texel10, const colour_t& texel01, const colour_t& texel11) const
+	{
+		if constexpr (std::is_same_v<colour_t, hRGBA>)
+		{
+			// The left texels of both rows widened together, and the right ones, so both rows blend at once
+			const Vec8f left = widen(texel00, texel01);
+			const Vec8f right = widen(texel10, texel11);
+			const Vec8f rows = left + (right - left) * (float)fraction[0];
+			fRGBA result;
+			(rows.get_low() + (rows.get_high() - rows.get_low()) * (float)fraction[1]).store(&result.R);
+			return result;
+		}
+		else
+		{
+			return Lerp(
+				Lerp(convert<fRGBA>(texel00), convert<fRGBA>(texel10), (float)fraction[0]),
+				Lerp(convert<fRGBA>(texel01), convert<fRGBA>(texel11), (float)fraction[0]),
+				(float)fraction[1]);
+		}
+	}
+};
+
+// The mip level, fractional between two levels, whose texels are footprint wide for a texture of width x height
+inline float mip_level(float footprint, int width, int height)
+{
+	return std::log2(footprint * std::max(width, height));
+}
+
+// Samples a mip mapped texture of width x height over footprint, with sample_level(level) sampling one level.
+// A footprint of one texel of a level is sampled from that level, and footprints between levels blend the two.
+template<typename sample_level_fn>
+fRGBA sample_mip_levels(float footprint, int width, int height, int level_count, sample_level_fn&& sample_level)
+{
+	const float level = mip_level(footprint, width, height);
+	if (!(level > 0))
+		return sample_level(0);
+
+	const int last_level = level_count - 1;
+	if (level >= last_level)
+		return sample_level(last_level);
+
+	const int finer = (int)level;
+	return Lerp(sample_level(finer), sample_level(finer + 1), level - finer);
+}
+
+// How an image texture orders its texels in memory
+enum class texel_layout
+{
+	row_major,
+	// 8x8 texel tiles, row by row, with the texels of each tile in Morton order (the bits of x and y
+	// interleaved) so every aligned 2x2, 4x4 and 8x8 block is contiguous. Texels close in y are then close
+	// in memory too, which helps lookups that move down the texture more than random ones.
+	// The "texture_layout" benchmark compares the two on the textures at hand.
+	tiled,
+};
+
+// Image texture, bilinear filtered. With mip maps it also keeps every level down to 1x1, each a box
+// filtered half of the one above, and sample(coords, footprint) blends the two levels around the footprint.
+// The texel layout is picked when the texture is made and doesn't change what it samples.
+// 8-bit colour types hold sRGB colour, fRGBA and hRGBA linear colour.
 template<typename colour_t>
 class texture2d : public texture
 {
-	using view_t = std::experimental::mdspan<colour_t, std::experimental::extents<int, std::experimental::dynamic_extent, std::experimental::dynamic_extent>>;
 	using channel_t = decltype(colour_t::R);
 
-	void* data = nullptr;
-	int size_x = 0;
-	int size_y = 0;
+	static constexpr int tile_size = 8; // The Morton order in texel_indices covers three bits
+
+	struct mip_level
+	{
+		int size_x = 0;
+		int size_y = 0;
+		int tiles_x = 0; // Tiles across, in the tiled layout
+		std::vector<colour_t> texels; // In layout order, the tiled layout pads to whole tiles
+	};
+
+	std::vector<mip_level> levels; // Empty if the texture couldn't be loaded
 	Vec2db wrap_xy = Vec2db(true, true);
+	texel_layout layout = texel_layout::row_major;
 
 public:
 	texture2d() = default;
 
-	texture2d(const char* filename, bool wrap_x, bool wrap_y)
+	texture2d(const char* filename, bool wrap_x, bool wrap_y, bool mip_maps = true, texel_layout order = texel_layout::row_major)
 		: wrap_xy(wrap_x, wrap_y)
 	{
+		int size_x = 0;
+		int size_y = 0;
 		int channels;
 
-		if constexpr (std::is_same_v<channel_t, float>)
+		if constexpr (std::is_same_v<colour_t, hRGBA>)
 		{
-			data = stbi_loadf(filename, &size_x, &size_y, &channels, colour_t::num_channels);
+			// Loaded as floats, then narrowed two texels at a time
+			const fRGBA* data = (const fRGBA*)stbi_loadf(filename, &size_x, &size_y, &channels, colour_t::num_channels);
+			if (!data)
+				return;
+
+			const size_t count = (size_t)size_x * size_y;
+			std::vector<colour_t> texels(count);
+			size_t i = 0;
+			for (; i + 2 <= count; i += 2)
+			{
+				to_float16(Vec8f().load(&data[i].R)).store(&texels[i]);
+			}
+			for (; i < count; ++i)
+			{
+				texels[i] = encode_texel<colour_t>(data[i]);
+			}
+			levels.push_back({ size_x, size_y, 0, std::move(texels) });
+			stbi_image_free((void*)data);
 		}
-		else if constexpr (std::is_same_v<channel_t, uint8_t>)
+		else
 		{
-			data = stbi_load(filename, &size_x, &size_y, &channels, colour_t::num_channels);
+			colour_t* data = nullptr;
+			if constexpr (std::is_same_v<channel_t, float>)
+			{
+				data = (colour_t*)stbi_loadf(filename, &size_x, &size_y, &channels, colour_t::num_channels);
+			}
+			else if constexpr (std::is_same_v<channel_t, uint8_t>)
+			{
+				data = (colour_t*)stbi_load(filename, &size_x, &size_y, &channels, colour_t::num_channels);
+			}
+			if (!data)
+				return;
+
+			levels.push_back({ size_x, size_y, 0, std::vector<colour_t>(data, data + (size_t)size_x * size_y) });
+			stbi_image_free(data);
 		}
+
+		if (mip_maps)
+			build_mip_maps();
+		if (order == texel_layout::tiled)
+			tile_levels();
 	}
 
-	texture2d(const texture2d&) = delete;
-	texture2d(texture2d&& rhs)
-		: data(rhs.data)
-		, size_x(rhs.size_x)
-		, size_y(rhs.size_y)
-		, wrap_xy(rhs.wrap_xy)
+	// From size_x * size_y texels, row by row
+	texture2d(int size_x, int size_y, std::vector<colour_t> texels, bool wrap_x, bool wrap_y, bool mip_maps = true, texel_layout order = texel_layout::row_major)
+		: wrap_xy(wrap_x, wrap_y)
 	{
-		rhs.data = nullptr;
-		rhs.size_x = 0;
-		rhs.size_y = 0;
-		rhs.wrap_xy = Vec2db(true, true);
+		levels.push_back({ size_x, size_y, 0, std::move(texels) });
+		if (mip_maps)
+			build_mip_maps();
+		if (order == texel_layout::tiled)
+			tile_levels();
 	}
 
-	~texture2d()
+	int width() const
 	{
-		stbi_image_free(data);
+		return levels.empty() ? 0 : levels[0].size_x;
 	}
 
-	auto as_view() const
+	int height() const
 	{
-		return view_t((colour_t*)data, size_y, size_x);
+		return levels.empty() ? 0 : levels[0].size_y;
 	}
 
 	fRGBA sample(Vec2d coords) const
 	{
-		const Vec2d scaled_coords = select(wrap_xy,
-			minimum(maximum(coords * Vec2d(size_x, size_y), Vec2d(0.0)), Vec2d(size_x - 1, size_y - 1)),
-			fmodulo(coords, 1.0) * Vec2d(size_x, size_y));
-		const Vec4i ic = truncate_to_int32(scaled_coords);
-		const Vec4i ic2 = truncate_to_int32(ceil(scaled_coords));
-		const Vec2d fc = scaled_coords - truncate(scaled_coords);
-
-		const auto view = as_view();
-		return Lerp(
-			Lerp(convert<fRGBA>(view(ic[1] , ic[0])), convert<fRGBA>(view(ic[1] , ic2[0])), (float)fc[0]),
-			Lerp(convert<fRGBA>(view(ic2[1], ic[0])), convert<fRGBA>(view(ic2[1], ic2[0])), (float)fc[0]),
-			(float)fc[1]);
+		return sample_level(levels[0], coords);
+	}
+
+	fRGBA sample(Vec2d coords, float footprint) const
+	{
+		return sample_mip_levels(footprint, width(), height(), (int)levels.size(), [&](int level) { return sample_level(levels[level], coords); });
+	}
+
+	int level_count() const
+	{
+		return (int)levels.size();
+	}
+
+	int level_width(int level) const
+	{
+		return levels[level].size_x;
+	}
+
+	int level_height(int level) const
+	{
+		return levels[level].size_y;
+	}
+
+	// Texel of a mip level as it is stored, for copying the texture elsewhere
+	const colour_t& stored_texel(int level, int x, int y) const
+	{
+		return levels[level].texels[texel_indices(levels[level], Vec4i(x, y, x, y))[0]];
+	}
+
+private:
+	fRGBA sample_level(const mip_level& level, Vec2d coords) const
+	{
+		const bilinear_taps taps(coords, level.size_x, level.size_y, wrap_xy);
+		const Vec4i index = texel_indices(level, taps.corners);
+		const colour_t* texels = level.texels.data();
+		return taps.blend(texels[index[0]], texels[index[1]], texels[index[2]], texels[index[3]]);
+	}
+
+	// Indices of the texels at (x0, y0), (x1, y0), (x0, y1) and (x1, y1), given x0, y0, x1 and y1.
+	// Each coordinate's part of the index is worked out once and the parts are added up in pairs.
+	Vec4i texel_indices(const mip_level& level, const Vec4i& corners) const
+	{
+		Vec4i offsets;
+		if (layout == texel_layout::tiled)
+		{
+			// Tile row and column, and the coordinate's three low bits spread out to every other bit
+			// of the Morton order, x to the even bits and y to the odd ones
+			const Vec4i tile = corners >> 3;
+			const Vec4i low = corners & (tile_size - 1);
+			const Vec4i morton = ((low & 1) | (low & 2) << 1 | (low & 4) << 2) * Vec4i(1, 2, 1, 2);
+			offsets = tile * (Vec4i(1, level.tiles_x, 1, level.tiles_x) * (tile_size * tile_size)) + morton;
+		}
+		else
+		{
+			offsets = corners * Vec4i(1, level.size_x, 1, level.size_x);
+		}
+		return permute4<0, 2, 0, 2>(offsets) + permute4<1, 1, 3, 3>(offsets);
+	}
+
+	fRGBA texel(const mip_level& level, int x, int y) const
+	{
+		return decode_texel(level.texels[texel_indices(level, Vec4i(x, y, x, y))[0]]);
+	}
+
+	// Each level averages 2x2 texels of the one above in linear colour, an odd last row or column with itself.
+	// Works on row major levels.
+	void build_mip_maps()
+	{
+		while (levels.back().size_x > 1 || levels.back().size_y > 1)
+		{
+			const mip_level& above = levels.back();
+			mip_level level = { (above.size_x + 1) / 2, (above.size_y + 1) / 2 };
+			level.texels.resize((size_t)level.size_x * level.size_y);
+
+			for (int y = 0; y < level.size_y; ++y)
+			{
+				const int y0 = std::min(y * 2, above.size_y - 1);
+				const int y1 = std::min(y * 2 + 1, above.size_y - 1);
+				for (int x = 0; x < level.size_x; ++x)
+				{
+					const int x0 = std::min(x * 2, above.size_x - 1);
+					const int x1 = std::min(x * 2 + 1, above.size_x - 1);
+					const fRGBA average = (texel(above, x0, y0) + texel(above, x1, y0) + texel(above, x0, y1) + texel(above, x1, y1)) * 0.25f;
+					level.texels[(size_t)y * level.size_x + x] = encode_texel<colour_t>(average);
+				}
+			}
+			levels.push_back(std::move(level));
+		}
+	}
+
+	// Reorders every level's texels from row major to tiled
+	void tile_levels()
+	{
+		layout = texel_layout::tiled;
+		for (mip_level& level : levels)
+		{
+			level.tiles_x = (level.size_x + tile_size - 1) / tile_size;
+			const int tiles_y = (level.size_y + tile_size - 1) / tile_size;
+			std::vector<colour_t> tiled((size_t)level.tiles_x * tiles_y * tile_size * tile_size);
+			for (int y = 0; y < level.size_y; ++y)
+			{
+				for (int x = 0; x < level.size_x; ++x)
+				{
+					tiled[texel_indices(level, Vec4i(x, y, x, y))[0]] = level.texels[(size_t)y * level.size_x + x];
+				}
+			}
+			level.texels = std::move(tiled);
+		}
 	}
 };
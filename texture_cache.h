@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "texture.h"
+
+// Header of a tiled texture file. Every mip level follows it in turn, from the full size level down
+// to 1x1, as rows of tile_size x tile_size tiles with each tile's texels row by row. Tiles past the
+// edge of a level repeat its last row and column.
+struct tiled_texture_header
+{
+	char magic[4];
+	uint32_t texel_size; // Bytes per texel, which must match the colour type the file is read as
+	uint32_t tile_size;
+	uint32_t level_count;
+	int32_t width;
+	int32_t height;
+
+	static constexpr char expected_magic[4] = { 'T', 'T', 'E', 'X' };
+};
+
+// Writes every mip level of tex to a tiled texture file. Returns false if the file couldn't be written.
+template<typename colour_t>
+bool write_tiled_texture(const texture2d<colour_t>& tex, const char* filename, int tile_size = 64)
+{
+	std::ofstream file(filename, std::ios::binary);
+	tiled_texture_header header = { {}, sizeof(colour_t), (uint32_t)tile_size, (uint32_t)tex.level_count(), tex.width(), tex.height() };
+	std::memcpy(header.magic, tiled_texture_header::expected_magic, sizeof(header.magic));
+	file.write((const char*)&header, sizeof(header));
+
+	std::vector<colour_t> tile((size_t)tile_size * tile_size);
+	for (int level = 0; level < tex.level_count(); ++level)
+	{
+		const int size_x = tex.level_width(level);
+		const int size_y = tex.level_height(level);
+		for (int tile_y = 0; tile_y < size_y; tile_y += tile_size)
+		{
+			for (int tile_x = 0; tile_x < size_x; tile_x += tile_size)
+			{
+				for (int y = 0; y < tile_size; ++y)
+				{
+					for (int x = 0; x < tile_size; ++x)
+					{
+						tile[(size_t)y * tile_size + x] = tex.stored_texel(level, std::min(tile_x + x, size_x - 1), std::min(tile_y + y, size_y - 1));
+					}
+				}
+				file.write((const char*)tile.data(), tile.size() * sizeof(colour_t));
+			}
+		}
+	}
+	return file.good();
+}
+
+// Tiles of cached textures held in memory, shared between any number of textures and threads. Tiles are
+// read on first use and the least recently used are dropped once the tiles held take more than budget
+// bytes, though a tile a lookup is still using stays alive until it's done. The tiles are split between
+// shards by a hash of their key, each with its own lock and an equal share of the budget, so threads
+// looking up different tiles rarely wait on each other. Small budgets get fewer shards, since a shard
+// that only holds a tile or two drops the tiles next to the one a lookup reads.
+class texture_cache
+{
+public:
+	struct statistics
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;    // Lookups that had to read their tile
+		uint64_t evictions = 0;
+		size_t resident_bytes = 0;
+	};
+
+	static constexpr int default_shard_count = 16;
+	static constexpr size_t min_shard_budget = 1 << 20;
+
+	explicit texture_cache(size_t budget, int shard_count = default_shard_count)
+		: shards(std::clamp<size_t>(budget / min_shard_budget, 1, std::max(shard_count, 1)))
+	{
+		for (shard& s : shards)
+		{
+			s.budget = budget / shards.size();
+		}
+	}
+
+	int shard_count() const
+	{
+		return (int)shards.size();
+	}
+
+	statistics stats() const
+	{
+		statistics total;
+		for (const shard& s : shards)
+		{
+			std::lock_guard lock(s.mutex);
+			total.hits += s.counters.hits;
+			total.misses += s.counters.misses;
+			total.evictions += s.counters.evictions;
+			total.resident_bytes += s.counters.resident_bytes;
+		}
+		return total;
+	}
+
+	// Zeroes the hit, miss and eviction counts
+	void reset_stats()
+	{
+		for (shard& s : shards)
+		{
+			std::lock_guard lock(s.mutex);
+			s.counters = { .resident_bytes = s.counters.resident_bytes };
+		}
+	}
+
+	// A number for a texture to make its tile keys unique with
+	uint32_t add_texture()
+	{
+		return next_texture++;
+	}
+
+	// The tile with key, which load(data) fills with size bytes if it isn't held. load is called without
+	// the cache locked, so lookups of other tiles carry on while a tile is read.
+	template<typename load_fn>
+	std::shared_ptr<const std::byte[]> tile(uint64_t key, size_t size, load_fn&& load)
+	{
+		// Neighbouring tiles differ in their low bits, which the multiply spreads to the top
+		shard& s = shards[((key * 0x9e3779b97f4a7c15ull) >> 32) % shards.size()];
+		{
+			std::lock_guard lock(s.mutex);
+			const auto found = s.tiles.find(key);
+			if (found != s.tiles.end())
+			{
+				++s.counters.hits;
+				s.lru.splice(s.lru.begin(), s.lru, found->second);
+				return found->second->data;
+			}
+			++s.counters.misses;
+		}
+
+		std::shared_ptr<std::byte[]> data = std::make_shared<std::byte[]>(size);
+		load(data.get());
+
+		std::lock_guard lock(s.mutex);
+		// Another thread may have read the same tile meanwhile
+		const auto found = s.tiles.find(key);
+		if (found != s.tiles.end())
+			return found->second->data;
+
+		s.lru.push_front({ key, data, size });
+		s.tiles.emplace(key, s.lru.begin());
+		s.counters.resident_bytes += size;
+		while (s.counters.resident_bytes > s.budget && s.lru.size() > 1)
+		{
+			const entry& oldest = s.lru.back();
+			s.counters.resident_bytes -= oldest.size;
+			++s.counters.evictions;
+			s.tiles.erase(oldest.key);
+			s.lru.pop_back();
+		}
+		return data;
+	}
+
+private:
+	struct entry
+	{
+		uint64_t key;
+		std::shared_ptr<const std::byte[]> data;
+		size_t size;
+	};
+
+	// Aligned to keep each shard's lock off its neighbours' cache lines
+	struct alignas(64) shard
+	{
+		size_t budget = 0;
+		mutable std::mutex mutex;
+		std::list<entry> lru; // Most recently used first
+		std::unordered_map<uint64_t, std::list<entry>::iterator> tiles;
+		statistics counters;
+	};
+
+	std::vector<shard> shards;
+	std::atomic<uint32_t> next_texture = 0;
+};
+
+// Texture read from a tiled texture file a tile at a time through a texture_cache, so only the tiles
+// in use take memory. Samples the same as the texture2d the file was written from.
+template<typename colour_t>
+class cached_texture : public texture
+{
+public:
+	// Empty if the file can't be read, wasn't written with colour_t texels or its header doesn't match its length
+	cached_texture(std::shared_ptr<texture_cache> cache, const char* filename, bool wrap_x, bool wrap_y)
+		: cache(std::move(cache))
+		, file(filename, std::ios::binary)
+		, wrap_xy(wrap_x, wrap_y)
+	{
+		tiled_texture_header header;
+		if (!file.read((char*)&header, sizeof(header)) || std::memcmp(header.magic, tiled_texture_header::expected_magic, sizeof(header.magic)) != 0
+			|| header.texel_size != sizeof(colour_t) || header.tile_size == 0 || header.tile_size > max_tile_size || header.width <= 0 || header.height <= 0)
+			return;
+
+		// Either the full size level alone or every level down to 1x1, taking up the rest of the file exactly
+		const int tile_size = (int)header.tile_size;
+		const size_t tile_bytes = (size_t)tile_size * tile_size * sizeof(colour_t);
+		std::vector<level_info> file_levels;
+		std::streamoff offset = sizeof(header);
+		int size_x = header.width;
+		int size_y = header.height;
+		while (true)
+		{
+			const level_info level = { size_x, size_y, (size_x + tile_size - 1) / tile_size, offset };
+			file_levels.push_back(level);
+			offset += (std::streamoff)((uint64_t)level.tiles_x * ((size_y + tile_size - 1) / tile_size) * tile_bytes);
+			if ((size_x == 1 && size_y == 1) || file_levels.size() == header.level_count)
+				break;
+			size_x = (size_x + 1) / 2;
+			size_y = (size_y + 1) / 2;
+		}
+		if (file_levels.size() != header.level_count || !file.seekg(0, std::ios::end) || file.tellg() != offset)
+			return;
+
+		id = this->cache->add_texture();
+		this->tile_size = tile_size;
+		this->tile_bytes = tile_bytes;
+		levels = std::move(file_levels);
+	}
+
+	int width() const
+	{
+		return levels.empty() ? 0 : levels[0].size_x;
+	}
+
+	int height() const
+	{
+		return levels.empty() ? 0 : levels[0].size_y;
+	}
+
+	// An empty texture is black
+	fRGBA sample(Vec2d coords) const
+	{
+		if (levels.empty())
+			return fRGBA(0, 0, 0, 0);
+
+		return sample_level(0, coords);
+	}
+
+	fRGBA sample(Vec2d coords, float footprint) const
+	{
+		if (levels.empty())
+			return fRGBA(0, 0, 0, 0);
+
+		return sample_mip_levels(footprint, width(), height(), (int)levels.size(), [&](int level) { return sample_level(level, coords); });
+	}
+
+private:
+	static constexpr uint32_t max_tile_size = 4096;
+
+	struct level_info
+	{
+		int size_x;
+		int size_y;
+		int tiles_x;
+		std::streamoff offset; // Of the level's first tile in the file
+	};
+
+	fRGBA sample_level(int level, Vec2d coords) const
+	{
+		const level_info& info = levels[level];
+		const bilinear_taps taps(coords, info.size_x, info.size_y, wrap_xy);
+
+		// The four texels are usually in one tile, which is then only looked up once
+		uint64_t tile_key = ~0ull;
+		std::shared_ptr<const std::byte[]> tile;
+		auto texel = [&](int x, int y)
+		{
+			const uint64_t tile_index = (uint64_t)(y / tile_size) * info.tiles_x + x / tile_size;
+			const uint64_t key = (uint64_t)id << 48 | (uint64_t)level << 40 | tile_index;
+			if (key != tile_key)
+			{
+				tile_key = key;
+				tile = cache->tile(key, tile_bytes, [&](std::byte* data) { read_tile(info.offset + (std::streamoff)(tile_index * tile_bytes), data); });
+			}
+			return ((const colour_t*)tile.get())[(size_t)(y % tile_size) * tile_size + x % tile_size];
+		};
+
+		const Vec4i corners = taps.corners;
+		const colour_t texel00 = texel(corners[0], corners[1]);
+		const colour_t texel10 = texel(corners[2], corners[1]);
+		const colour_t texel01 = texel(corners[0], corners[3]);
+		const colour_t texel11 = texel(corners[2], corners[3]);
+		return taps.blend(texel00, texel10, texel01, texel11);
+	}
+
+	// A tile that can't be read is black
+	void read_tile(std::streamoff offset, std::byte* data) const
+	{
+		std::lock_guard lock(file_mutex);
+		file.clear();
+		if (!file.seekg(offset) || !file.read((char*)data, tile_bytes))
+			std::memset(data, 0, tile_bytes);
+	}
+
+	std::shared_ptr<texture_cache> cache;
+	mutable std::ifstream file;
+	mutable std::mutex file_mutex;
+	std::vector<level_info> levels; // Empty if the file couldn't be read
+	Vec2db wrap_xy;
+	uint32_t id = 0;
+	int tile_size = 0;
+	size_t tile_bytes = 0;
+};
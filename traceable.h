@@ -1,11 +1,48 @@
 #pragma once
 
-#include <optional>
+#include "aabb.h"
 #include "ray.h"
 
-class traceable
+// Something rays can hit, traced in the precision of T
+template <typename T>
+class basic_traceable
 {
 public:
-    virtual ~traceable() {}
-    virtual std::optional<ray_intersection> ray_intersect(const ray& r) = 0;
+    using packet = typename vector_types<T>::packet;
+
+    virtual ~basic_traceable() {}
+    // Closest intersection with t in [t_min, t_max], written to hit. Returns false and leaves hit alone if there is none.
+    virtual bool ray_intersect(const basic_ray<T>& r, T t_min, T t_max, basic_ray_intersection<T>& hit) const = 0;
+
+    // Whether the ray hits anything with t in [t_min, t_max], for shadow and visibility rays. Overrides stop at
+    // the first hit they find and make no intersection, by default it is the closest hit that is found.
+    virtual bool occluded(const basic_ray<T>& r, T t_min, T t_max) const
+    {
+        basic_ray_intersection<T> hit;
+        return ray_intersect(r, t_min, t_max, hit);
+    }
+
+    // Distance to the closest intersection of each ray of the packet with t in [t_min, t_max[i]],
+    // infinity for the rays that miss. Tests the rays one at a time unless overridden.
+    virtual packet ray_distances(const basic_ray_packet<T>& rays, T t_min, const packet& t_max) const
+    {
+        T t[basic_ray_packet<T>::size];
+        for (int i = 0; i < basic_ray_packet<T>::size; ++i)
+        {
+            basic_ray_intersection<T> hit;
+            t[i] = ray_intersect(rays.rays[i], t_min, t_max[i], hit) ? hit.t : std::numeric_limits<T>::infinity();
+        }
+        return packet().load(t);
+    }
+
+    // Writes the intersection ray_distances found for ray r at distance t to hit. By default traced again from t_min,
+    // since the closest intersection in [t_min, t] is also the closest from t_min on.
+    virtual void make_intersection(const basic_ray<T>& r, T t_min, T t, basic_ray_intersection<T>& hit) const
+    {
+        ray_intersect(r, t_min, std::numeric_limits<T>::infinity(), hit);
+    }
+
+    virtual basic_aabb<T> bounds() const = 0;
 };
+
+using traceable = basic_traceable<double>;
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common/tiny_obj_loader/tiny_obj_loader.h"
+
+#include "bvh.h"
+#include "traceable.h"
+
+// Triangle mesh loaded from a Wavefront OBJ file, with one material for the whole mesh.
+// Vertices that share a position, normal and texture coordinate are stored once and the triangles
+// index them. For tracing, the triangles are also packed structure-of-arrays in packets of
+// packet_size, in BVH order like sphere_set, with a BVH over the packets. The packets are single
+// precision either way, T is the precision of the BVH and of the hits.
+template <typename T>
+class basic_triangle_mesh : public basic_traceable<T>
+{
+public:
+    using aabb = basic_aabb<T>;
+    using vec3 = vec3_t<T>;
+    static constexpr int packet_size = 8;
+
+    struct vertex
+    {
+        float position[3];
+        float normal[3];   // Zero if the file has no normal for the vertex
+        float texcoord[2];
+    };
+
+    // Leaves the mesh empty, and reports why, if the file can't be loaded
+    basic_triangle_mesh(const char* filename, int material)
+        : material(material)
+    {
+        const auto start_time = std::chrono::steady_clock::now();
+
+        tinyobj::ObjReaderConfig config;
+        config.triangulate = true;
+        config.vertex_color = false;
+
+        tinyobj::ObjReader reader;
+        if (!reader.ParseFromFile(filename, config))
+        {
+            std::cerr << "Failed to load " << filename << ": " << reader.Error() << '\n';
+            return;
+        }
+
+        const tinyobj::attrib_t& attrib = reader.GetAttrib();
+
+        struct index_hash
+        {
+            size_t operator()(const tinyobj::index_t& index) const
+            {
+                return std::hash<uint64_t>()(((uint64_t)(uint32_t)index.vertex_index << 32 | (uint32_t)index.normal_index) * 0x9E3779B97F4A7C15ull ^ (uint32_t)index.texcoord_index);
+            }
+        };
+        struct index_equal
+        {
+            bool operator()(const tinyobj::index_t& a, const tinyobj::index_t& b) const
+            {
+                return a.vertex_index == b.vertex_index && a.normal_index == b.normal_index && a.texcoord_index == b.texcoord_index;
+            }
+        };
+        std::unordered_map<tinyobj::index_t, uint32_t, index_hash, index_equal> vertex_lookup;
+        vertex_lookup.reserve(attrib.vertices.size() / 3);
+
+        for (const tinyobj::shape_t& shape : reader.GetShapes())
+        {
+            indices.reserve(indices.size() + shape.mesh.indices.size());
+            for (const tinyobj::index_t& index : shape.mesh.indices)
+            {
+                const auto [entry, added] = vertex_lookup.try_emplace(index, (uint32_t)vertices.size());
+                if (added)
+                {
+                    vertex v = {};
+                    std::copy_n(&attrib.vertices[3 * index.vertex_index], 3, v.position);
+                    if (index.normal_index >= 0)
+                        std::copy_n(&attrib.normals[3 * index.normal_index], 3, v.normal);
+                    if (index.texcoord_index >= 0)
+                        std::copy_n(&attrib.texcoords[2 * index.texcoord_index], 2, v.texcoord);
+                    vertices.push_back(v);
+                }
+                indices.push_back(entry->second);
+            }
+        }
+
+        std::cout << "Loaded " << filename << " in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() << "s: "
+            << vertices.size() << " vertices, " << triangle_count() << " triangles\n";
+    }
+
+    size_t triangle_count() const
+    {
+        return indices.size() / 3;
+    }
+
+    bool ray_intersect(const basic_ray<T>& r, T t_min, T t_max, basic_ray_intersection<T>& hit) const
+    {
+        prepare();
+
+        // Möller-Trumbore against a packet of triangles at a time, in single precision like the packets
+        const Vec8f origin[3] = { Vec8f((float)r.origin.get_x()), Vec8f((float)r.origin.get_y()), Vec8f((float)r.origin.get_z()) };
+        const Vec8f direction[3] = { Vec8f((float)r.direction.get_x()), Vec8f((float)r.direction.get_y()), Vec8f((float)r.direction.get_z()) };
+
+        int hit_triangle = -1;
+        refined_hit hit_refined;
+        packet_bvh.traverse(r, t_min, t_max, [&](int packet_index, T& t_limit)
+            {
+                const triangle_packet& packet = packets[packet_index];
+                Vec8f t_hit = triangle_distances(packet, origin, direction, (float)t_min, (float)t_limit);
+                // The single precision distance can be off by more than the range is from its ends, so
+                // the closest lane that's still in range once refined is the hit
+                for (float closest = horizontal_min(t_hit); closest != std::numeric_limits<float>::infinity(); closest = horizontal_min(t_hit))
+                {
+                    const int lane = horizontal_find_first(t_hit == Vec8f(closest));
+                    refined_hit refined;
+                    if (refine_hit(r, packet.triangle[lane], t_min, t_limit, refined))
+                    {
+                        t_limit = refined.t;
+                        hit_triangle = packet.triangle[lane];
+                        hit_refined = refined;
+                        break;
+                    }
+                    t_hit.insert(lane, std::numeric_limits<float>::infinity());
+                }
+            });
+
+        if (hit_triangle < 0)
+        {
+            return false;
+        }
+
+        triangle_intersection(r, hit_triangle, hit_refined, hit);
+        return true;
+    }
+
+    bool occluded(const basic_ray<T>& r, T t_min, T t_max) const
+    {
+        prepare();
+
+        const Vec8f origin[3] = { Vec8f((float)r.origin.get_x()), Vec8f((float)r.origin.get_y()), Vec8f((float)r.origin.get_z()) };
+        const Vec8f direction[3] = { Vec8f((float)r.direction.get_x()), Vec8f((float)r.direction.get_y()), Vec8f((float)r.direction.get_z()) };
+
+        return packet_bvh.traverse_any(r, t_min, t_max, [&](int packet_index)
+            {
+                return horizontal_min(triangle_distances(packets[packet_index], origin, direction, (float)t_min, (float)t_max)) != std::numeric_limits<float>::infinity();
+            });
+    }
+
+    aabb bounds() const
+    {
+        prepare();
+        return packet_bvh.empty() ? aabb() : packet_bvh.bounds();
+    }
+
+    // Packs the triangles and builds the BVH over the packets, which ray_intersect and bounds do themselves on first use
+    void prepare() const
+    {
+        std::call_once(built, [this]() { build(); });
+    }
+
+public:
+    std::vector<vertex> vertices;
+    std::vector<uint32_t> indices; // Three vertices per triangle, counter-clockwise seen from the front
+    int material; // Index into the scene's materials
+
+private:
+    struct triangle_packet
+    {
+        Vec8f v0[3];    // x, y and z of the first vertex
+        Vec8f edge1[3]; // v1 - v0
+        Vec8f edge2[3]; // v2 - v0
+        int triangle[packet_size];
+    };
+
+    vec3 position(uint32_t vertex_index) const
+    {
+        const float* p = vertices[vertex_index].position;
+        return vec3(p[0], p[1], p[2]);
+    }
+
+    // Distance the ray hits each triangle of the packet at within [t_min, t_max], infinity in the lanes it misses
+    static Vec8f triangle_distances(const triangle_packet& packet, const Vec8f (&origin)[3], const Vec8f (&direction)[3], float t_min, float t_max)
+    {
+        // p = direction x edge2, q = (origin - v0) x edge1
+        const Vec8f p_x = direction[1] * packet.edge2[2] - direction[2] * packet.edge2[1];
+        const Vec8f p_y = direction[2] * packet.edge2[0] - direction[0] * packet.edge2[2];
+        const Vec8f p_z = direction[0] * packet.edge2[1] - direction[1] * packet.edge2[0];
+        const Vec8f det = packet.edge1[0] * p_x + packet.edge1[1] * p_y + packet.edge1[2] * p_z;
+        const Vec8f inv_det = 1.0f / det;
+
+        const Vec8f s_x = origin[0] - packet.v0[0];
+        const Vec8f s_y = origin[1] - packet.v0[1];
+        const Vec8f s_z = origin[2] - packet.v0[2];
+        const Vec8f u = (s_x * p_x + s_y * p_y + s_z * p_z) * inv_det;
+
+        const Vec8f q_x = s_y * packet.edge1[2] - s_z * packet.edge1[1];
+        const Vec8f q_y = s_z * packet.edge1[0] - s_x * packet.edge1[2];
+        const Vec8f q_z = s_x * packet.edge1[1] - s_y * packet.edge1[0];
+        const Vec8f v = (direction[0] * q_x + direction[1] * q_y + direction[2] * q_z) * inv_det;
+        const Vec8f t = (packet.edge2[0] * q_x + packet.edge2[1] * q_y + packet.edge2[2] * q_z) * inv_det;
+
+        // Also false for parallel rays, whose inverse determinant is infinite, and the NaN padding
+        const Vec8fb hit = u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= t_min && t <= t_max && is_finite(inv_det);
+        return select(hit, t, Vec8f(std::numeric_limits<float>::infinity()));
+    }
+
+    // Distance and barycentric coordinates of a hit, in the precision of T
+    struct refined_hit
+    {
+        T t;
+        T u;
+        T v;
+    };
+
+    // Redoes the intersection with one triangle the packets found in the precision of T, which keeps the hit
+    // location on the surface even when the packet's distance is off. False if the refined distance is
+    // outside [t_min, t_max], or the ray is parallel to the triangle, so the packet's hit can't be trusted.
+    bool refine_hit(const basic_ray<T>& r, int triangle, T t_min, T t_max, refined_hit& refined) const
+    {
+        const uint32_t* corner = &indices[3 * triangle];
+        const vec3 v0 = position(corner[0]);
+        const vec3 edge1 = position(corner[1]) - v0;
+        const vec3 edge2 = position(corner[2]) - v0;
+        const vec3 p = cross_product(r.direction, edge2);
+        const vec3 s = r.origin - v0;
+        const vec3 q = cross_product(s, edge1);
+        const T det = dot_product(edge1, p);
+        if (det == 0)
+            return false;
+
+        refined.t = dot_product(edge2, q) / det;
+        refined.u = dot_product(s, p) / det;
+        refined.v = dot_product(r.direction, q) / det;
+        return refined.t >= t_min && refined.t <= t_max;
+    }
+
+    void triangle_intersection(const basic_ray<T>& r, int triangle, const refined_hit& refined, basic_ray_intersection<T>& hit) const
+    {
+        const uint32_t* corner = &indices[3 * triangle];
+        const vertex& a = vertices[corner[0]];
+        const vertex& b = vertices[corner[1]];
+        const vertex& c = vertices[corner[2]];
+
+        const vec3 v0 = position(corner[0]);
+        const vec3 face_normal = cross_product(position(corner[1]) - v0, position(corner[2]) - v0);
+        const T t = refined.t;
+        const T u = refined.u;
+        const T v = refined.v;
+        const T w = 1 - u - v;
+
+        // Faces point the way their winding does, which decides the side. Shading uses the smooth normals
+        // where the file has them.
+        vec3 normal = vec3(a.normal[0], a.normal[1], a.normal[2]) * w + vec3(b.normal[0], b.normal[1], b.normal[2]) * u + vec3(c.normal[0], c.normal[1], c.normal[2]) * v;
+        if (dot_product(normal, normal) == 0)
+            normal = face_normal;
+
+        hit.location = r.at(t);
+        hit.set_normal(r, face_normal, normalize_vector(normal));
+        hit.texcoord = Vec2d(a.texcoord[0], a.texcoord[1]) * w + Vec2d(b.texcoord[0], b.texcoord[1]) * u + Vec2d(c.texcoord[0], c.texcoord[1]) * v;
+        // Texture coordinates per unit of distance, taken as the same in every direction across the triangle
+        const float uv_area = std::abs((b.texcoord[0] - a.texcoord[0]) * (c.texcoord[1] - a.texcoord[1]) - (c.texcoord[0] - a.texcoord[0]) * (b.texcoord[1] - a.texcoord[1]));
+        const T area = std::sqrt(dot_product(face_normal, face_normal));
+        hit.texcoord_footprint = area > 0 ? r.cone_width_at(t) * std::sqrt(uv_area / (float)area) : 0.0f;
+        hit.material = material;
+        hit.t = t;
+    }
+
+    void build() const
+    {
+        const int count = (int)triangle_count();
+        std::vector<aabb> bounds(count);
+        for (int i = 0; i < count; ++i)
+        {
+            for (int corner = 0; corner < 3; ++corner)
+            {
+                bounds[i].grow(position(indices[3 * i + corner]));
+            }
+        }
+
+        basic_bvh<T> triangle_bvh;
+        triangle_bvh.build(bounds);
+        const std::span<const int> order = triangle_bvh.primitive_order();
+
+        // Lanes past the last triangle get a NaN first vertex, which never hits
+        const int packet_count = (int)(order.size() + packet_size - 1) / packet_size;
+        packets.resize(packet_count);
+        std::vector<aabb> packet_bounds(packet_count);
+        for (int i = 0; i < packet_count; ++i)
+        {
+            float v0[3][packet_size], edge1[3][packet_size], edge2[3][packet_size];
+            for (int lane = 0; lane < packet_size; ++lane)
+            {
+                const size_t order_index = (size_t)i * packet_size + lane;
+                if (order_index < order.size())
+                {
+                    const int triangle = order[order_index];
+                    const float* a = vertices[indices[3 * triangle]].position;
+                    const float* b = vertices[indices[3 * triangle + 1]].position;
+                    const float* c = vertices[indices[3 * triangle + 2]].position;
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        v0[axis][lane] = a[axis];
+                        edge1[axis][lane] = b[axis] - a[axis];
+                        edge2[axis][lane] = c[axis] - a[axis];
+                    }
+                    packets[i].triangle[lane] = triangle;
+                    packet_bounds[i].grow(bounds[triangle]);
+                }
+                else
+                {
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        v0[axis][lane] = std::numeric_limits<float>::quiet_NaN();
+                        edge1[axis][lane] = edge2[axis][lane] = 0;
+                    }
+                    packets[i].triangle[lane] = -1;
+                }
+            }
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                packets[i].v0[axis].load(v0[axis]);
+                packets[i].edge1[axis].load(edge1[axis]);
+                packets[i].edge2[axis].load(edge2[axis]);
+            }
+        }
+
+        packet_bvh.build(packet_bounds);
+    }
+
+    // Built from vertices and indices by prepare()
+    mutable std::once_flag built;
+    mutable std::vector<triangle_packet> packets;
+    mutable basic_bvh<T> packet_bvh;
+};
+
+using triangle_mesh = basic_triangle_mesh<double>;